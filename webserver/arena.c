@@ -0,0 +1,93 @@
+#include "common.h"
+#include "arena.h"
+
+#define ARENA_CHUNK 4096	/* the smallest chunk, header included */
+#define ARENA_SPARES 64		/* smallest chunks kept by each thread */
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;		/* bytes after the header */
+	/* keeps what follows aligned */
+	char mem[] __attribute__((aligned(16)));
+};
+
+/* smallest chunks of destroyed arenas, for the next ones, so that an arena
+ * per connection costs no heap call either */
+static __thread struct arena_chunk *arena_spares;
+static __thread int nr_arena_spares;
+
+void
+arena_init(struct arena *a)
+{
+	a->chunks = NULL;
+	a->cur = NULL;
+	a->used = 0;
+}
+
+/* returns size bytes, aligned like malloc would, that stay valid until the
+ * arena is reset */
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk **next, *c;
+	void *p;
+
+	size = (size + 15) & ~(size_t)15;
+	/* move on to the next chunk that is large enough, if cur is full */
+	while (a->cur && a->used + size > a->cur->size) {
+		a->cur = a->cur->next;
+		a->used = 0;
+	}
+	if (!a->cur) {
+		/* a new one at the end */
+		size_t chunk = ARENA_CHUNK - sizeof(struct arena_chunk);
+
+		if (size > chunk)
+			chunk = size;
+		if (chunk == ARENA_CHUNK - sizeof(struct arena_chunk) &&
+		    arena_spares) {
+			c = arena_spares;
+			arena_spares = c->next;
+			nr_arena_spares--;
+		} else {
+			c = Malloc(sizeof(struct arena_chunk) + chunk);
+			c->size = chunk;
+		}
+		c->next = NULL;
+		for (next = &a->chunks; *next; next = &(*next)->next)
+			;
+		*next = c;
+		a->cur = c;
+		a->used = 0;
+	}
+	p = a->cur->mem + a->used;
+	a->used += size;
+	return p;
+}
+
+/* takes back everything handed out, keeping the chunks */
+void
+arena_reset(struct arena *a)
+{
+	a->cur = a->chunks;
+	a->used = 0;
+}
+
+void
+arena_destroy(struct arena *a)
+{
+	struct arena_chunk *c, *next;
+
+	for (c = a->chunks; c; c = next) {
+		next = c->next;
+		if (c->size == ARENA_CHUNK - sizeof(struct arena_chunk) &&
+		    nr_arena_spares < ARENA_SPARES) {
+			c->next = arena_spares;
+			arena_spares = c;
+			nr_arena_spares++;
+		} else {
+			free(c);
+		}
+	}
+	arena_init(a);
+}
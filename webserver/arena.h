@@ -0,0 +1,24 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/* a bump allocator for memory that is only needed while a request is being
+ * served. arena_alloc hands out the next bytes of a chunk, and arena_reset
+ * takes all of them back at once when the request is done. the chunks are
+ * kept for the next request, so once they have grown large enough, serving a
+ * request makes no heap calls. */
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *chunks;	/* the first one */
+	struct arena_chunk *cur;	/* being handed out */
+	size_t used;			/* bytes of cur handed out */
+};
+
+void arena_init(struct arena *a);
+void *arena_alloc(struct arena *a, size_t size);
+void arena_reset(struct arena *a);
+void arena_destroy(struct arena *a);
+
+#endif /* __ARENA_H__ */
@@ -0,0 +1,742 @@
+#include "request.h"
+#include "common.h"
+#include "debug.h"
+#include "cache.h"
+#include "sketch.h"
+#include "epoch.h"
+#include "slab.h"
+#include "spill.h"
+
+/* globals */
+static cache_shard *cache_shards = NULL;
+static int nr_cache_shards = 0;
+static int cache_admission = ADMIT_ALL;
+static int cache_admit_threshold = 0;
+static struct spill *cache_spill = NULL;	/* the warm tier, if any */
+
+/* an evicted file waiting for the shard lock to be dropped, see cache_unlock */
+struct cache_victim {
+	struct file_data *data;		/* holds a reference */
+	struct cache_victim *next;
+};
+
+const char *cache_admissions[] = { "all", "size", "freq", NULL };
+const char *cache_backends[] = { "heap", "mmap", NULL };
+
+/* every request needs a file_data, and every cached file a node and an
+ * entry */
+static struct slab file_data_slab;
+static struct slab node_slab;
+static struct slab entry_slab;
+
+/* file data */
+
+/* initialize file data */
+struct file_data *
+file_data_init(void)
+{
+	struct file_data *data;
+
+	data = slab_alloc(&file_data_slab);
+	data->file_name = NULL;
+	data->file_buf = NULL;
+	data->file_size = 0;
+	data->mapped = 0;
+	data->file_csum = 0;
+	data->file_type = NULL;
+	data->header = NULL;
+	data->header_len = 0;
+	data->gzip = NULL;
+	data->file_mtime = 0;
+	data->checked = 0;
+	data->refs = 1;
+	return data;
+}
+
+/* free all file data */
+static void
+file_data_free(struct file_data *data)
+{
+	if (data->file_name != data->file_name_buf) {
+		FREE_STR(data->file_name);
+	}
+	FREE_STR(data->header);
+	if (data->gzip) {
+		free(data->gzip->buf);
+		free(data->gzip->header);
+		free(data->gzip);
+	}
+	if (data->mapped) {
+		SYS(munmap(data->file_buf, data->file_size));
+		data->file_buf = NULL;
+	}
+#ifdef DEBUG
+	if (data->file_buf) {
+		memset(data->file_buf, 0, data->file_size);
+	}
+#endif
+	free(data->file_buf);
+
+	slab_free(&file_data_slab, data);
+}
+
+struct file_data *
+file_data_get(struct file_data *data)
+{
+	__atomic_add_fetch(&data->refs, 1, __ATOMIC_RELAXED);
+	return data;
+}
+
+void
+file_data_put(struct file_data *data)
+{
+	if (__atomic_sub_fetch(&data->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		file_data_free(data);
+	}
+}
+
+/* returns the number of bytes of data that are in memory. that is all of a
+ * heap copy, but only the resident pages of a mapping */
+static unsigned
+file_data_resident(struct file_data *data)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	unsigned char vec[64];
+	unsigned long pages, i, j;
+	unsigned resident = 0;
+
+	if (!data->mapped)
+		return data->file_size;
+
+	pages = (data->file_size + page_size - 1) / page_size;
+	/* mincore reports one byte per page, ask for a few pages at a time */
+	for (i = 0; i < pages; i += sizeof(vec)) {
+		unsigned long n = pages - i < sizeof(vec) ? pages - i
+							  : sizeof(vec);
+
+		SYS(mincore(data->file_buf + i * page_size, n * page_size,
+			    vec));
+		for (j = 0; j < n; j++) {
+			if (vec[j] & 1)
+				resident += page_size;
+		}
+	}
+	return resident < (unsigned)data->file_size ? resident
+						     : data->file_size;
+}
+
+/* the bytes a gzip variant adds to its file's charge, see cache_gzip */
+static unsigned
+file_variant_size(const struct file_variant *v)
+{
+	return v && v->buf ? v->size + v->header_len : 0;
+}
+
+/* cache implementation */
+
+int
+cache_admission_find(const char *name)
+{
+	int i;
+
+	for (i = 0; cache_admissions[i]; i++) {
+		if (!strcmp(cache_admissions[i], name))
+			return i;
+	}
+	return -1;
+}
+
+static struct cache_table *
+table_init(unsigned nr_buckets)
+{
+	struct cache_table *t;
+
+	t = calloc(1, sizeof(struct cache_table) +
+		   nr_buckets * sizeof(struct cache_entry *));
+	assert(t);
+	t->nr_buckets = nr_buckets;
+	return t;
+}
+
+/* frees a table that has been replaced, along with its entries */
+static void
+table_free(void *t_v)
+{
+	struct cache_table *t = t_v;
+	unsigned i;
+
+	for (i = 0; i < t->nr_buckets; ++i) {
+		struct cache_entry *e = t->buckets[i];
+		while (e) {
+			struct cache_entry *next = e->next;
+			slab_free(&entry_slab, e);
+			e = next;
+		}
+	}
+	free(t);
+}
+
+/* frees a deleted entry and its node, and drops the cache's reference to the
+ * node's data */
+static void
+entry_free(void *e_v)
+{
+	struct cache_entry *e = e_v;
+
+	file_data_put(e->n->data);
+	slab_free(&node_slab, e->n);
+	slab_free(&entry_slab, e);
+}
+
+int
+cache_backend_find(const char *name)
+{
+	int i;
+
+	for (i = 0; cache_backends[i]; i++) {
+		if (!strcmp(cache_backends[i], name))
+			return i;
+	}
+	return -1;
+}
+
+void
+cache_init(int nr_shards, int max_cache_size,
+	   const struct cache_policy *policy, int admission,
+	   int admit_threshold, unsigned long spill_size)
+{
+	int i;
+
+	assert(nr_shards > 0);
+	nr_cache_shards = nr_shards;
+	cache_admission = admission;
+	cache_admit_threshold = admit_threshold;
+	if (spill_size)
+		cache_spill = spill_init(spill_size);
+	slab_init(&file_data_slab, sizeof(struct file_data));
+	slab_init(&node_slab, sizeof(node));
+	slab_init(&entry_slab, sizeof(struct cache_entry));
+	cache_shards = Malloc(sizeof(cache_shard) * nr_shards);
+
+	for (i = 0; i < nr_shards; ++i) {
+		cache_shard *sh = &cache_shards[i];
+
+		pthread_mutex_init(&sh->lock, NULL);
+		sh->table = table_init(BUCKETS);
+		sh->nr_entries = 0;
+		sh->usage = 0;
+		sh->max_size = max_cache_size / nr_shards;
+		sh->policy = policy;
+		sh->policy_state = policy->init(sh->max_size);
+		sh->admit_sketch = NULL;
+		if (admission == ADMIT_FREQ)
+			sh->admit_sketch = sketch_init(sh->max_size / 4096);
+		sh->flights = NULL;
+		sh->victims = NULL;
+		sh->hits = sh->misses = sh->coalesced = 0;
+		sh->admitted = sh->rejected = 0;
+		sh->admitted_bytes = sh->rejected_bytes = sh->evicted_bytes = 0;
+	}
+}
+
+/* the low bits of the hash pick the shard, the rest pick the bucket within
+ * the shard, see bucket_of() */
+cache_shard *
+cache_shard_for(const char *file_name)
+{
+	unsigned long h = hash(file_name, strlen(file_name));
+	return &cache_shards[h % nr_cache_shards];
+}
+
+static unsigned
+bucket_of(struct cache_table *t, unsigned long h)
+{
+	return (h / nr_cache_shards) % t->nr_buckets;
+}
+
+/* adds e to the front of its bucket in t. readers see either the old or the
+ * new bucket head, and e is fully written before it becomes visible */
+static void
+table_add(struct cache_table *t, struct cache_entry *e)
+{
+	unsigned b = bucket_of(t, e->hash);
+
+	e->next = t->buckets[b];
+	__atomic_store_n(&t->buckets[b], e, __ATOMIC_RELEASE);
+}
+
+/* double the number of buckets once there are more entries than buckets, so
+ * that bucket chains stay short no matter how many files are cached. readers
+ * may still be walking the old table, so the entries are copied into the new
+ * one and the old table is retired as a whole */
+static void
+cache_grow(cache_shard *sh)
+{
+	struct cache_table *old = sh->table;
+	struct cache_table *t = table_init(old->nr_buckets * 2);
+	unsigned i;
+
+	for (i = 0; i < old->nr_buckets; ++i) {
+		struct cache_entry *curr;
+		for (curr = old->buckets[i]; curr; curr = curr->next) {
+			struct cache_entry *e = slab_alloc(&entry_slab);
+
+			e->hash = curr->hash;
+			e->name = curr->name;
+			e->n = curr->n;
+			table_add(t, e);
+		}
+	}
+	__atomic_store_n(&sh->table, t, __ATOMIC_RELEASE);
+	epoch_retire(old, table_free);
+}
+
+node *
+make_node(struct file_data *data, unsigned long hash)
+{
+	node *newnode = slab_alloc(&node_slab);
+
+	newnode->data = data;
+	newnode->hash = hash;
+	newnode->size = 0;
+	newnode->dead = 0;
+	INIT_LIST_HEAD(&newnode->list);
+	newnode->where = 0;
+	newnode->freq = 0;
+	newnode->policy_data = NULL;
+	newnode->hits = 0;
+	newnode->seen = 0;
+	return newnode;
+}
+
+/* djb2 string hash algorithm from http://www.cse.yorku.ca/~oz/hash.html */
+unsigned long
+hash(const char *str, int len)
+{
+	unsigned long hash = 5381;
+	int i;
+
+	for (i = 0; i < len; ++i) {
+		hash = ((hash << 5) + hash) + str[i]; /* hash * 33 + c */
+	}
+
+	return hash;
+}
+
+node *
+cache_lookup(cache_shard *sh, struct file_data *data)
+{
+	assert(data);
+	assert(data->file_name);
+	unsigned long h = hash(data->file_name, strlen(data->file_name));
+	struct cache_table *t = __atomic_load_n(&sh->table, __ATOMIC_ACQUIRE);
+	struct cache_entry *curr;
+
+	curr = __atomic_load_n(&t->buckets[bucket_of(t, h)], __ATOMIC_ACQUIRE);
+	while (curr) {
+		if (curr->hash == h && !strcmp(curr->name, data->file_name)) {
+			return curr->n;
+		}
+		curr = __atomic_load_n(&curr->next, __ATOMIC_ACQUIRE);
+	}
+	return NULL;
+}
+
+/* inserts data, evicting other files if it would overfill the shard */
+node *
+cache_insert(cache_shard *sh, struct file_data *data)
+{
+	unsigned long h = hash(data->file_name, strlen(data->file_name));
+	unsigned size = file_data_resident(data);
+	int evict_amount = sh->usage + size - sh->max_size;
+	struct cache_entry *e;
+	node *n;
+
+	assert(!cache_lookup(sh, data));
+	if (evict_amount > 0) {
+		cache_evict(sh, evict_amount);
+	}
+	if (sh->nr_entries >= sh->table->nr_buckets) {
+		cache_grow(sh);
+	}
+
+	n = make_node(file_data_get(data), h);
+	n->size = size;
+	e = slab_alloc(&entry_slab);
+	e->hash = h;
+	e->name = data->file_name;
+	e->n = n;
+	table_add(sh->table, e);
+	sh->policy->insert(sh->policy_state, n);
+
+	sh->nr_entries++;
+	sh->usage += size;
+
+	DEBUG_PRINT("cache insert %s", data->file_name);
+	return n;
+}
+
+/* removes n from the shard, returning the number of bytes freed. readers that
+ * found n before it was unlinked may still use it, so n is freed once they are
+ * done, and the file data once the requests still sending it are done */
+int
+cache_delete(cache_shard *sh, node *n)
+{
+	int deleted;
+	struct cache_table *t = sh->table;
+	struct cache_entry **curr = &t->buckets[bucket_of(t, n->hash)];
+	struct cache_entry *e;
+
+	DEBUG_PRINT("deleting %s", n->data->file_name);
+
+	while ((*curr)->n != n) {
+		curr = &((*curr)->next);
+		assert(*curr);
+	}
+	e = *curr;
+	__atomic_store_n(curr, e->next, __ATOMIC_RELEASE);
+	n->dead = 1;
+	sh->policy->remove(sh->policy_state, n);
+
+	sh->nr_entries--;
+	sh->usage -= n->size;
+	/* a reader that found n before it was unlinked may still count a hit,
+	 * it is not missed much */
+	sh->hits += __atomic_load_n(&n->hits, __ATOMIC_RELAXED);
+	deleted = n->size;
+	epoch_retire(e, entry_free);
+
+	return deleted;
+}
+
+void
+cache_remove(cache_shard *sh, struct file_data *data)
+{
+	node *n = cache_lookup(sh, data);
+
+	if (n && n->data == data)
+		cache_delete(sh, n);
+}
+
+/* returns 1 if data may be inserted into the shard, 0 if it is too big or the
+ * admission filter rejects it */
+int
+cache_admit(cache_shard *sh, struct file_data *data)
+{
+	int admit = data->file_size <= sh->max_size;
+
+	if (admit && cache_admission == ADMIT_SIZE) {
+		admit = data->file_size <= cache_admit_threshold;
+	} else if (admit && cache_admission == ADMIT_FREQ) {
+		unsigned long h = hash(data->file_name, strlen(data->file_name));
+		double requests = sketch_estimate(sh->admit_sketch, h);
+
+		admit = requests * cache_admit_threshold >= data->file_size;
+	}
+
+	if (admit) {
+		sh->admitted++;
+		sh->admitted_bytes += data->file_size;
+	} else {
+		sh->rejected++;
+		sh->rejected_bytes += data->file_size;
+	}
+	return admit;
+}
+
+/* evicts the nodes chosen by the eviction policy until amount bytes have been
+ * freed, or the shard is empty. with a warm tier, they are queued for the
+ * spill file, see cache_unlock */
+void cache_evict(cache_shard *sh, int amount)
+{
+	struct cache_victim *v;
+	node *victim;
+	int deleted;
+
+	while (amount > 0 &&
+	       (victim = sh->policy->victim(sh->policy_state)) != NULL) {
+		if (cache_spill) {
+			v = Malloc(sizeof(struct cache_victim));
+			v->data = file_data_get(victim->data);
+			v->next = sh->victims;
+			sh->victims = v;
+		}
+		deleted = cache_delete(sh, victim);
+		amount -= deleted;
+		sh->evicted_bytes += deleted;
+	}
+}
+
+/* n was requested and found in the cache */
+void cache_touch(cache_shard *sh, node *n)
+{
+	sh->hits++;
+	sh->policy->touch(sh->policy_state, n);
+}
+
+/* the shard is not written at all, only n, which the hit reads anyway. n may
+ * have been deleted since it was looked up, then the hit is not seen by the
+ * policy, which has forgotten n */
+void cache_touch_nolock(cache_shard *sh, node *n)
+{
+	__atomic_add_fetch(&n->hits, 1, __ATOMIC_RELAXED);
+}
+
+/* data was requested but is not in the cache */
+void cache_miss(cache_shard *sh, struct file_data *data)
+{
+	unsigned long h = hash(data->file_name, strlen(data->file_name));
+
+	sh->misses++;
+	if (sh->admit_sketch)
+		sketch_increment(sh->admit_sketch, h);
+	sh->policy->miss(sh->policy_state, h);
+}
+
+struct file_variant *
+cache_gzip(struct file_data *data, struct file_variant *v)
+{
+	cache_shard *sh = cache_shard_for(data->file_name);
+	struct file_variant *old;
+	int evict_amount;
+	node *n;
+
+	pthread_mutex_lock(&sh->lock);
+	n = cache_lookup(sh, data);
+	old = data->gzip;
+	if (old || !n || n->data != data) {
+		/* another request published one first, or the file has been
+		 * evicted and will not be sent for much longer */
+		cache_unlock(sh);
+		return old;
+	}
+	if (n->size + file_variant_size(v) > sh->max_size) {
+		/* the file is sent as it is from now on */
+		free(v->buf);
+		free(v->header);
+		v->buf = v->header = NULL;
+		v->header_len = 0;
+	}
+	n->size += file_variant_size(v);
+	sh->usage += file_variant_size(v);
+	__atomic_store_n(&data->gzip, v, __ATOMIC_RELEASE);
+	/* n itself may go, its charge with it */
+	evict_amount = sh->usage - sh->max_size;
+	if (evict_amount > 0) {
+		cache_evict(sh, evict_amount);
+	}
+	cache_unlock(sh);
+	return v;
+}
+
+void cache_unlock(cache_shard *sh)
+{
+	struct cache_victim *v = sh->victims, *next;
+
+	sh->victims = NULL;
+	pthread_mutex_unlock(&sh->lock);
+	for (; v; v = next) {
+		next = v->next;
+		spill_put(cache_spill, v->data);
+		file_data_put(v->data);
+		free(v);
+	}
+}
+
+/* reads data->file_name back from the warm tier, see spill.h. returns 0 if
+ * it is not there, or there is no warm tier */
+int cache_unspill(struct file_data *data)
+{
+	return cache_spill && spill_get(cache_spill, data);
+}
+
+void
+cache_foreach(void (*fn)(struct file_data *data, void *arg), void *arg)
+{
+	struct cache_entry *e;
+	unsigned i;
+	int s;
+
+	for (s = 0; s < nr_cache_shards; ++s) {
+		cache_shard *sh = &cache_shards[s];
+
+		pthread_mutex_lock(&sh->lock);
+		for (i = 0; i < sh->table->nr_buckets; ++i) {
+			for (e = sh->table->buckets[i]; e; e = e->next)
+				fn(e->n->data, arg);
+		}
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
+
+int
+cache_restore(struct file_data *data)
+{
+	cache_shard *sh = cache_shard_for(data->file_name);
+	int restore;
+
+	/* hits read the header as soon as the data is inserted */
+	assert(data->header);
+	pthread_mutex_lock(&sh->lock);
+	restore = (unsigned)data->file_size <= sh->max_size &&
+		!cache_lookup(sh, data) && !cache_flight_find(sh, data);
+	if (restore) {
+		cache_insert(sh, data);
+	}
+	cache_unlock(sh);
+	return restore;
+}
+
+/* singleflight */
+
+struct flight *
+cache_flight_find(cache_shard *sh, struct file_data *data)
+{
+	unsigned long h = hash(data->file_name, strlen(data->file_name));
+	struct flight *f;
+
+	for (f = sh->flights; f; f = f->next) {
+		if (f->hash == h && !strcmp(f->data->file_name, data->file_name))
+			return f;
+	}
+	return NULL;
+}
+
+struct flight *
+cache_flight_start(cache_shard *sh, struct file_data *data)
+{
+	struct flight *f = Malloc(sizeof(struct flight));
+
+	f->data = data;
+	f->hash = hash(data->file_name, strlen(data->file_name));
+	f->done = 0;
+	f->ok = 0;
+	f->users = 1;
+	pthread_cond_init(&f->cond, NULL);
+	f->next = sh->flights;
+	sh->flights = f;
+	return f;
+}
+
+struct file_data *
+cache_flight_wait(cache_shard *sh, struct flight *f)
+{
+	struct file_data *data;
+
+	sh->coalesced++;
+	f->users++;
+	while (!f->done) {
+		pthread_cond_wait(&f->cond, &sh->lock);
+	}
+	/* cache_flight_finish took our reference */
+	data = f->ok ? f->data : NULL;
+	if (--f->users == 0) {
+		pthread_cond_destroy(&f->cond);
+		free(f);
+	}
+	return data;
+}
+
+void
+cache_flight_finish(cache_shard *sh, struct flight *f, int ok)
+{
+	struct flight **curr = &sh->flights;
+
+	while (*curr != f) {
+		assert(*curr);
+		curr = &((*curr)->next);
+	}
+	*curr = f->next;
+
+	f->done = 1;
+	f->ok = ok;
+	if (ok) {
+		__atomic_add_fetch(&f->data->refs, f->users - 1,
+				   __ATOMIC_RELAXED);
+	}
+	pthread_cond_broadcast(&f->cond);
+	if (--f->users == 0) {
+		pthread_cond_destroy(&f->cond);
+		free(f);
+	}
+}
+
+void cache_print()
+{
+	printf("%d|cache\n%d|\t", pthread_t_to_small_int(pthread_self()),
+		   pthread_t_to_small_int(pthread_self()));
+	int s;
+	unsigned i;
+	for (s = 0; s < nr_cache_shards; ++s) {
+		struct cache_table *t = cache_shards[s].table;
+		for (i = 0; i < t->nr_buckets; ++i) {
+			struct cache_entry *curr = t->buckets[i];
+			while (curr) {
+				if (curr->n->data->file_name) {
+					printf("%s:%d:%d,",
+					       curr->n->data->file_name,
+					       curr->n->data->refs,
+					       curr->n->where);
+				}
+				curr = curr->next;
+			}
+		}
+	}
+	printf("\n");
+}
+
+void cache_stats(FILE *out)
+{
+	unsigned long hits = 0, misses = 0, coalesced = 0;
+	unsigned long admitted = 0, rejected = 0;
+	unsigned long admitted_bytes = 0, rejected_bytes = 0, evicted_bytes = 0;
+	unsigned usage = 0;
+	unsigned long resident = 0;
+	int s;
+	unsigned i;
+
+	for (s = 0; s < nr_cache_shards; ++s) {
+		cache_shard *sh = &cache_shards[s];
+
+		pthread_mutex_lock(&sh->lock);
+		hits += sh->hits;
+		misses += sh->misses;
+		coalesced += sh->coalesced;
+		usage += sh->usage;
+		admitted += sh->admitted;
+		rejected += sh->rejected;
+		admitted_bytes += sh->admitted_bytes;
+		rejected_bytes += sh->rejected_bytes;
+		evicted_bytes += sh->evicted_bytes;
+		for (i = 0; i < sh->table->nr_buckets; ++i) {
+			struct cache_entry *e;
+			for (e = sh->table->buckets[i]; e; e = e->next) {
+				resident += file_data_resident(e->n->data) +
+					file_variant_size(e->n->data->gzip);
+				hits += __atomic_load_n(&e->n->hits,
+							__ATOMIC_RELAXED);
+			}
+		}
+		pthread_mutex_unlock(&sh->lock);
+	}
+	fprintf(out, "cache policy = %s\n", cache_shards[0].policy->name);
+	fprintf(out, "cache admission = %s\n", cache_admissions[cache_admission]);
+	fprintf(out, "cache hits = %lu\n", hits);
+	fprintf(out, "cache misses = %lu\n", misses);
+	/* misses that waited for another request's read */
+	fprintf(out, "cache misses coalesced = %lu\n", coalesced);
+	fprintf(out, "cache usage = %u\n", usage);
+	/* less than usage if the kernel paged out mapped files */
+	fprintf(out, "cache resident = %lu\n", resident);
+	/* rejected bytes were neither copied into the cache nor did they push
+	 * other files out */
+	fprintf(out, "files admitted = %lu (%lu bytes)\n", admitted,
+		admitted_bytes);
+	fprintf(out, "files rejected = %lu (%lu bytes saved)\n", rejected,
+		rejected_bytes);
+	fprintf(out, "bytes evicted = %lu\n", evicted_bytes);
+	fprintf(out, "hit ratio = %.4f\n",
+		hits + misses ? (double)hits / (hits + misses) : 0.0);
+	if (cache_spill)
+		spill_stats(cache_spill, out);
+}
@@ -0,0 +1,208 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <pthread.h>
+#include <stdio.h>
+#include "list.h"
+#include "policy.h"
+
+struct file_data;
+struct file_variant;
+struct cache_victim;
+
+/* initial number of buckets per shard, the table doubles when it holds more
+ * entries than buckets */
+#ifdef DEBUG
+#define BUCKETS 2
+#else
+#define BUCKETS 1024
+#endif
+
+typedef struct node_ {
+	struct file_data *data;	/* the cache holds one reference */
+	unsigned long hash;	/* hash of data->file_name */
+	unsigned size;		/* bytes charged to the shard, see cache_insert */
+	int dead;		/* deleted, freed once no reader can see it */
+	/* eviction policy bookkeeping, see policy.c */
+	struct list_head list;	/* position in the policy's lists */
+	int where;		/* which of the policy's lists the node is on */
+	unsigned freq;		/* use count or reference bit */
+	void *policy_data;
+	/* hits found without the lock, counted here so that hits on different
+	 * files share no cache line. the policy takes them in when it next
+	 * looks at n for an eviction, see policy_pending() */
+	unsigned long hits;
+	unsigned long seen;	/* of those, the ones the policy has taken in */
+} node;
+
+/* hash buckets are read without a lock, see cache_lookup(). an entry never
+ * changes once it is in a bucket, except that a writer may point next past a
+ * deleted entry. deleted entries, nodes and replaced tables are freed through
+ * epoch_retire(). */
+struct cache_entry {
+	unsigned long hash;
+	const char *name;	/* n->data->file_name, saves a pointer chase */
+	node *n;
+	struct cache_entry *next;
+};
+
+struct cache_table {
+	unsigned nr_buckets;
+	struct cache_entry *buckets[];
+};
+
+/* a cache miss that is being read from disk. requests that miss on the same
+ * file while it is being read wait for the reader and share its copy instead
+ * of reading the file again. */
+struct flight {
+	struct file_data *data;	/* the reader's file data */
+	unsigned long hash;
+	int done;		/* the reader has finished */
+	int ok;			/* the read succeeded */
+	int users;		/* reader and waiters that still use the flight */
+	pthread_cond_t cond;	/* signalled when done */
+	struct flight *next;
+};
+
+/* the cache is split into shards, each with its own lock, hash buckets, usage
+ * counter and eviction policy state. a file always maps to the same shard, so
+ * requests for files in different shards never contend on a lock. lookups
+ * take no lock at all, the lock serializes inserts, deletes and the eviction
+ * policy. */
+typedef struct cache_shard_ {
+	pthread_mutex_t lock;
+	struct cache_table *table;
+	unsigned nr_entries;
+	unsigned usage;		/* bytes charged to this shard */
+	unsigned max_size;	/* max_cache_size / nr_shards */
+	const struct cache_policy *policy;
+	void *policy_state;
+	struct sketch *admit_sketch;	/* recent requests, for ADMIT_FREQ */
+	struct flight *flights;		/* files being read */
+	struct cache_victim *victims;	/* evicted, for the warm tier, see
+					 * cache_unlock */
+	unsigned long hits, misses, coalesced;	/* hits, besides those
+						 * counted in the nodes */
+	unsigned long admitted, rejected;
+	unsigned long admitted_bytes, rejected_bytes, evicted_bytes;
+} cache_shard;
+
+/* admission filters, deciding whether a file that was just read may enter the
+ * cache. the threshold is in bytes.
+ *
+ * ADMIT_ALL:  every file that fits in the shard
+ * ADMIT_SIZE: files of at most threshold bytes
+ * ADMIT_FREQ: files whose number of recent requests, estimated by a frequency
+ *             sketch, times threshold is at least their size. small files get
+ *             in on their first request, a file of 4 * threshold bytes needs
+ *             4 recent requests. */
+enum { ADMIT_ALL, ADMIT_SIZE, ADMIT_FREQ };
+
+extern const char *cache_admissions[];	/* names, indexed by ADMIT_* */
+int cache_admission_find(const char *name);
+
+/* backing stores for cached files
+ *
+ * CACHE_HEAP: files are copied into memory from the heap
+ * CACHE_MMAP: files are mapped, they cost no heap and no copy, and the kernel
+ *             can page them out under memory pressure */
+enum { CACHE_HEAP, CACHE_MMAP };
+
+extern const char *cache_backends[];	/* names, indexed by CACHE_* */
+int cache_backend_find(const char *name);
+
+/* with a spill_size, files evicted from memory go to a warm tier of that
+ * many bytes on disk, see spill.h */
+void cache_init(int nr_shards, int max_cache_size,
+		const struct cache_policy *policy, int admission,
+		int admit_threshold, unsigned long spill_size);
+cache_shard *cache_shard_for(const char *file_name);
+
+/* file data is reference counted. once a file has been read, its data is
+ * never changed, so it can be sent by any number of requests at once, and it
+ * stays alive until the last of them is done, even if it has been evicted
+ * from the cache by then. file_data_init returns data with one reference.
+ * file data, like the cache's nodes, comes from a slab (see slab.h), so
+ * cache_init must have been called first. */
+struct file_data *file_data_init(void);
+struct file_data *file_data_get(struct file_data *data);
+void file_data_put(struct file_data *data);
+
+node *make_node(struct file_data *data, unsigned long hash);
+unsigned long hash(const char *str, int len);
+
+/* cache_lookup may be called with sh->lock held, or without it between
+ * epoch_enter() and epoch_exit(). in the latter case the node and its data
+ * stay valid until epoch_exit(), even if the node is deleted meanwhile, so a
+ * reference taken with file_data_get() before then is safe.
+ *
+ * cache_touch_nolock records a hit found without the lock, and must be called
+ * before epoch_exit(). it only counts the hit in n, so a hit never takes or
+ * waits for the lock, and the eviction policy takes the hits in under the
+ * lock when it looks for a victim. */
+node *cache_lookup(cache_shard *sh, struct file_data *data);
+void  cache_touch_nolock(cache_shard *sh, node *n);
+
+/* all of these must be called with sh->lock held. cache_insert takes a
+ * reference to data, cache_delete drops it once no reader can see the node.
+ *
+ * a file is charged to the shard for the bytes it has in memory when it is
+ * inserted: its size if it was copied to the heap, its resident pages if it is
+ * mapped, see request_readfile(). its gzip variant is added once it is made,
+ * see cache_gzip() */
+node *cache_insert(cache_shard *sh, struct file_data *data);
+int   cache_delete(cache_shard *sh, node *n);
+/* deletes the node of data->file_name if it still holds data, e.g. once data
+ * is found stale. unlike an eviction, the file does not go to the warm tier */
+void  cache_remove(cache_shard *sh, struct file_data *data);
+int   cache_admit (cache_shard *sh, struct file_data *data);
+void  cache_evict (cache_shard *sh, int amount);
+void  cache_touch (cache_shard *sh, node *n);
+void  cache_miss  (cache_shard *sh, struct file_data *data);
+void  cache_print ();
+
+/* unlocks sh, then hands the files that were evicted while it was held to the
+ * warm tier, which is not written to with a shard lock held. callers that
+ * may have evicted, with cache_insert, unlock with this */
+void cache_unlock(cache_shard *sh);
+
+/* publishes v as the gzip variant of data, see request_gzip(), and charges it
+ * to the shard along with the file, evicting other files if the shard would
+ * overfill. a variant that would not fit in the shard with its file is
+ * emptied first, so the file is sent as it is. returns the variant data has
+ * now, v or one published before it, or NULL if data is not cached and v was
+ * not published. takes the shard lock */
+struct file_variant *cache_gzip(struct file_data *data,
+				struct file_variant *v);
+
+/* called without a lock, by the reader of a miss before it goes to disk */
+int cache_unspill(struct file_data *data);
+
+/* for saving and restoring the cache across restarts, take the shard locks.
+ * cache_foreach calls fn on the data of every cached file, with its shard
+ * locked. cache_restore inserts data that was read by other means, and whose
+ * header has been built, unless the file is cached or being read already,
+ * and returns whether it did */
+void cache_foreach(void (*fn)(struct file_data *data, void *arg), void *arg);
+int cache_restore(struct file_data *data);
+
+/* singleflight for cache misses, called with sh->lock held.
+ *
+ * find:    returns the flight reading data->file_name, or NULL
+ * start:   registers the caller as the reader of data->file_name
+ * wait:    joins f as a waiter and waits until the reader is done. returns a
+ *          reference to the data that was read, or NULL if the file was not
+ *          read into memory
+ * finish:  called by the reader once data is read into memory (ok), or once
+ *          it is known that it will not be (the file could not be opened or
+ *          is not cached). takes a reference to the data for each waiter */
+struct flight *cache_flight_find(cache_shard *sh, struct file_data *data);
+struct flight *cache_flight_start(cache_shard *sh, struct file_data *data);
+struct file_data *cache_flight_wait(cache_shard *sh, struct flight *f);
+void cache_flight_finish(cache_shard *sh, struct flight *f, int ok);
+
+/* prints hit, miss and admission counts summed over all shards, and the bytes
+ * of the cached files that are in memory right now. takes the shard locks */
+void cache_stats(FILE *out);
+
+#endif /* __CACHE_H__ */
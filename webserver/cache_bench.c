@@ -0,0 +1,157 @@
+/*
+ * cache_bench.c: measures the cost of a cache hit as the number of cached
+ * files grows.
+ *
+ * To run:
+ *  cache_bench [-p policy] [-t nr_threads] [nr_hits]
+ *
+ * Fills a single cache shard with 100, 1000, 10000 and 100000 files and, for
+ * each size, times nr_hits random hits in each of nr_threads threads (1 by
+ * default). Each hit does what do_server_request does on a hit: look the file
+ * up without a lock, take a reference to its data, count the hit in the node
+ * for the eviction policy (lru by default), and drop the reference. Since all
+ * threads hit the same shard, the aggregate rate shows how well hits scale
+ * with threads.
+ *
+ * Random hits over all the files get slower as the files outgrow the CPU
+ * caches, since each hit then misses on the bucket, the entry, the file data
+ * and the policy's neighbours of the entry. The hash table keeps its chains
+ * short, so this is not the lookup or the policy doing more work. To show
+ * that, each size is also timed with hits on the same HOT_FILES files only,
+ * which stay in the CPU caches however many files the shard holds. The hot
+ * column should stay flat, and the miss column is the difference, the cost of
+ * the memory accesses alone.
+ */
+
+#include "common.h"
+#include "request.h"
+#include "cache.h"
+#include "policy.h"
+#include "epoch.h"
+
+#define MAX_FILES 100000
+#define DEFAULT_NR_HITS 1000000
+#define MAX_THREADS 256
+/* few enough that their entries, data and list nodes stay in the CPU caches */
+#define HOT_FILES 100
+
+static struct file_data **files;
+static int nr_hits = DEFAULT_NR_HITS;
+
+static struct file_data *
+bench_file(int i)
+{
+	struct file_data *data = file_data_init();
+
+	data->file_name = Malloc(32);
+	snprintf(data->file_name, 32, "./fileset_dir/%05d", i);
+	data->file_size = 4096;
+	return data;
+}
+
+/* each thread makes nr_hits hits on the first size files */
+static void *
+bench_hits(void *size_v)
+{
+	int size = *(int *)size_v;
+	unsigned seed = (unsigned)(unsigned long)pthread_self();
+	int i;
+
+	for (i = 0; i < nr_hits; i++) {
+		struct file_data *data = files[rand_r(&seed) % size];
+		cache_shard *sh = cache_shard_for(data->file_name);
+		struct file_data *shared;
+		node *cached;
+
+		epoch_enter();
+		cached = cache_lookup(sh, data);
+		assert(cached);
+		shared = file_data_get(cached->data);
+		cache_touch_nolock(sh, cached);
+		epoch_exit();
+		file_data_put(shared);
+	}
+	return NULL;
+}
+
+/* returns the wall clock time of a hit in one thread, in ns, when nr_threads
+ * threads each make nr_hits hits on the first size files */
+static double
+bench_run(int nr_threads, int size)
+{
+	pthread_t threads[MAX_THREADS];
+	struct timeval start, end, diff;
+	int i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nr_threads; i++) {
+		SYS(pthread_create(&threads[i], NULL, bench_hits, &size));
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &diff);
+	return (diff.tv_sec * 1e9 + diff.tv_usec * 1e3) / nr_hits;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int nr_threads = 1;
+	int nr_files = 0;
+	const struct cache_policy *policy = cache_policies[0];
+	int size, c;
+
+	while ((c = getopt(argc, argv, "p:t:")) != -1) {
+		switch (c) {
+		case 'p':
+			policy = cache_policy_find(optarg);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		default:
+			policy = NULL;
+		}
+	}
+	if (!policy || nr_threads < 1 || nr_threads > MAX_THREADS ||
+	    argc > optind + 1) {
+		fprintf(stderr, "Usage: %s [-p policy] [-t nr_threads] "
+			"[nr_hits]\n", argv[0]);
+		exit(1);
+	}
+	if (argc == optind + 1) {
+		nr_hits = atoi(argv[optind]);
+		assert(nr_hits > 0);
+	}
+
+	/* one shard that never needs to evict */
+	cache_init(1, MAX_FILES * 4096, policy, ADMIT_ALL, 0, 0);
+	files = Malloc(sizeof(struct file_data *) * MAX_FILES);
+
+	printf("policy = %s, threads = %d\n", policy->name, nr_threads);
+	printf("%8s %12s %12s %12s %12s\n", "files", "ns/hit", "Mhits/s",
+	       "hot ns/hit", "miss ns/hit");
+	for (size = 100; size <= MAX_FILES; size *= 10) {
+		double ns, hot_ns;
+
+		for (; nr_files < size; nr_files++) {
+			struct file_data *data = bench_file(nr_files);
+			cache_shard *sh = cache_shard_for(data->file_name);
+
+			pthread_mutex_lock(&sh->lock);
+			cache_insert(sh, data);
+			cache_unlock(sh);
+			file_data_put(data);
+			/* a separate lookup key, like the one request_init fills */
+			files[nr_files] = bench_file(nr_files);
+		}
+
+		ns = bench_run(nr_threads, size);
+		hot_ns = bench_run(nr_threads, HOT_FILES);
+		printf("%8d %12.1f %12.2f %12.1f %12.1f\n", size, ns,
+		       nr_threads * 1e3 / ns, hot_ns, ns - hot_ns);
+	}
+	exit(0);
+}
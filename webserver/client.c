@@ -21,35 +21,71 @@
  *
  */
 
+#include <zlib.h>
 #include "common.h"
+#include "csum.h"
 
-/* send an HTTP request for the specified file */
+/* send an HTTP request for the specified file. an HTTP/1.1 request keeps the
+ * connection open for more requests. with gzip, the server may send the body
+ * gzipped */
 static void
-client_send(int fd, char *host, char *filename)
+client_send(int fd, char *host, char *filename, int keep_alive, int gzip)
 {
 	char buf[MAXLINE];
+	int n;
 
 	/* create the request line */
-	sprintf(buf, "GET %s HTTP/1.0\r\n", filename);
+	n = sprintf(buf, "GET %s HTTP/1.%d\r\n", filename, keep_alive ? 1 : 0);
+	if (gzip) {
+		n += sprintf(buf + n, "Accept-Encoding: gzip\r\n");
+	}
 	/* create one request header line for the server host, 
 	   and then the empty line */
-	sprintf(buf, "%shost: %s\r\n\r\n", buf, host);
-	Rio_write(fd, buf, strlen(buf));
+	n += sprintf(buf + n, "host: %s\r\n\r\n", host);
+	Rio_write(fd, buf, n);
 }
 
-/* read the HTTP response and print it out */
-static void
-client_print(int fd, unsigned int orig_csum, int orig_length, int print)
+/* decompresses the n bytes of a gzipped body in buf, adding the checksum of
+ * what they decompress to to *csum. returns how many bytes that is */
+static int
+client_inflate(z_stream *zs, char *buf, int n, unsigned int *csum)
+{
+	char out[MAXBUF];
+	int ret, len = 0;
+
+	zs->next_in = (Bytef *)buf;
+	zs->avail_in = n;
+	do {
+		zs->next_out = (Bytef *)out;
+		zs->avail_out = sizeof(out);
+		ret = inflate(zs, Z_NO_FLUSH);
+		assert(ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR);
+		*csum += csum_buf(out, sizeof(out) - zs->avail_out);
+		len += sizeof(out) - zs->avail_out;
+	} while (zs->avail_out == 0);
+	return len;
+}
+
+/* read the HTTP response and print it out. on a connection that is kept
+ * open, the body ends after Content-Length bytes rather than when the server
+ * closes the connection. a gzipped body is decompressed to check it, its
+ * Content-Length is that of the gzipped body, and its Content-Csum that of
+ * the file. returns 0 if the server is closing the connection anyway */
+static int
+client_print(struct rio *rio, unsigned int orig_csum, int orig_length,
+	     int print, int keep_alive)
 {
-	struct rio *rio;
 	char buf[MAXBUF];
-	int i, n;
+	int n;
 	int length = 0;
 	int length_received = 0;
+	int length_decoded = 0;
 	unsigned int csum = 0;
 	unsigned int csum_received = 0;
-	
-	rio = Rio_init(fd);
+	int open = keep_alive;
+	int gzip = 0;
+	int ret;
+	z_stream zs;
 
 	/* read and display the HTTP header */
 	n = Rio_readlineb(rio, buf, MAXBUF);
@@ -66,27 +102,52 @@ client_print(int fd, unsigned int orig_csum, int orig_length, int print)
 		if (sscanf(buf, "Content-Csum: %u ", &csum) == 1) {
 			/* found csum tag */
 		}
+		if (!strncasecmp(buf, "Connection: close", 17)) {
+			open = 0;
+		}
+		if (!strncasecmp(buf, "Content-Encoding: gzip", 22)) {
+			gzip = 1;
+		}
 	}
 
+	if (gzip) {
+		memset(&zs, 0, sizeof(zs));
+		/* 16 more window bits expect a gzip header and trailer */
+		ret = inflateInit2(&zs, 15 + 16);
+		assert(ret == Z_OK);
+	}
 	fflush(stdout);
 	/* read and display the HTTP body */
 	do {
-		n = Rio_readlineb(rio, buf, MAXBUF);
+		if (keep_alive) {
+			n = length - length_received;
+			n = Rio_readnb(rio, buf, n < MAXBUF ? n : MAXBUF);
+		} else {
+			n = Rio_readlineb(rio, buf, MAXBUF);
+		}
 		if (print) {
 			Rio_write(STDOUT_FILENO, buf, n);
 		}
 		length_received += n;
-		for (i = 0; i < n; i++) {
-			csum_received += (unsigned char)buf[i];
+		if (gzip) {
+			length_decoded += client_inflate(&zs, buf, n,
+							 &csum_received);
+		} else {
+			length_decoded += n;
+			csum_received += csum_buf(buf, n);
 		}
 	} while (n > 0);
+	if (gzip) {
+		inflateEnd(&zs);
+	}
 
 	assert(orig_csum == csum);
-	assert(orig_length == length);
+	assert(orig_length == length_decoded);
+	assert(gzip || orig_length == length);
 
 	assert(length == length_received);
 	assert(csum == csum_received);
-	Rio_destroy(rio);
+	return open;
 }
 
 struct fileinfo {
@@ -103,40 +164,136 @@ struct client {
 	struct fileinfo *fileset;
 	int nr_files;
 	int timing_mode;
+	int nr_hot;	/* if not 0, only request the first nr_hot files */
+	int depth;	/* if not 0, reuse connections, with up to depth
+			 * requests in flight on each */
+	int gzip;	/* accept gzipped bodies */
 };
 
+/* get a random file from the file set */
+static int
+client_pick(struct client *cl)
+{
+	int fnr;
+
+	fnr = rand_self_similar_int(0.2, cl->nr_hot ? cl->nr_hot :
+				    cl->nr_files);
+	fnr--;
+	/* for debugging */
+	// fprintf(stderr, "requesting file: %s\n", 
+	// cl->fileset[fnr].name);
+	return fnr;
+}
+
+/* make all the requests of a thread on one connection, sending the next
+ * requests before the responses to the previous ones have arrived. that only
+ * starts once the first response shows that the server keeps the connection
+ * open. if the server closes it, the requests it did not answer are sent again
+ * on a new one */
+static void
+client_request_keep_alive(struct client *cl)
+{
+	struct rio *rio;
+	struct fileinfo *fi;
+	int *fnrs;	/* the files requested, indexed modulo depth */
+	int picked, sent, done;
+	int clientfd;
+	int open, window;
+
+	fnrs = Malloc(sizeof(int) * cl->depth);
+	picked = done = 0;
+	while (done < cl->nr_times) {
+		clientfd = open_clientfd(cl->host, cl->port);
+		rio = Rio_init(clientfd);
+		open = 1;
+		window = 1;
+		for (sent = done; open && done < cl->nr_times; done++) {
+			while (sent < cl->nr_times && sent - done < window) {
+				if (sent == picked) {
+					fnrs[picked++ % cl->depth] =
+						client_pick(cl);
+				}
+				fi = &cl->fileset[fnrs[sent++ % cl->depth]];
+				client_send(clientfd, cl->host, fi->name, 1,
+				    cl->gzip);
+			}
+			fi = &cl->fileset[fnrs[done % cl->depth]];
+			open = client_print(rio, fi->csum, fi->len,
+					    (cl->timing_mode == 0), 1);
+			window = cl->depth;
+		}
+		Rio_destroy(rio);
+		SYS(close(clientfd));
+	}
+	free(fnrs);
+}
+
 /* open a single connection to the specified host and port */
 static void *
 client_request(void *arg)
 {
 	struct client *cl = (struct client *)arg;
+	struct rio *rio;
 	int clientfd;
 	int i;
 
+	if (cl->depth) {
+		client_request_keep_alive(cl);
+		return NULL;
+	}
 	for (i = 0; i < cl->nr_times; i++) {
 		int fnr;
 
 		clientfd = open_clientfd(cl->host, cl->port);
-		/* get a random file from the file set */
-		fnr = rand_self_similar_int(0.2, cl->nr_files);
-		fnr--;
-		/* for debugging */
-		// fprintf(stderr, "requesting file: %s\n", 
-		// cl->fileset[fnr].name);
-		client_send(clientfd, cl->host, cl->fileset[fnr].name);
+		fnr = client_pick(cl);
+		client_send(clientfd, cl->host, cl->fileset[fnr].name, 0,
+			    cl->gzip);
 		/* when timing_mode is 1, then don't print anything */
-		client_print(clientfd, cl->fileset[fnr].csum, 
-			     cl->fileset[fnr].len, (cl->timing_mode == 0));
+		rio = Rio_init(clientfd);
+		client_print(rio, cl->fileset[fnr].csum, 
+			     cl->fileset[fnr].len, (cl->timing_mode == 0), 0);
+		Rio_destroy(rio);
 		SYS(close(clientfd));
 	}
 	return NULL;
 }
 
+/* request each of the first nr_hot files once, so that a server with a large
+ * enough cache has them all cached before the timed run */
+static void
+client_warm(struct client *cl)
+{
+	struct rio *rio;
+	int clientfd;
+	int i;
+
+	for (i = 0; i < cl->nr_hot; i++) {
+		clientfd = open_clientfd(cl->host, cl->port);
+		client_send(clientfd, cl->host, cl->fileset[i].name, 0,
+			    cl->gzip);
+		rio = Rio_init(clientfd);
+		client_print(rio, cl->fileset[i].csum, cl->fileset[i].len,
+			     0, 0);
+		Rio_destroy(rio);
+		SYS(close(clientfd));
+	}
+}
+
 static void
 usage(char *program)
 {
-	fprintf(stderr, "Usage: %s [-t] host port nr_times nr_threads fileset\n",
-		program);
+	fprintf(stderr, "Usage: %s [-t] [-c nr_hot] [-k depth] [-g] host port "
+		"nr_times nr_threads fileset\n", program);
+	fprintf(stderr, "  -t         timing mode, print only the run time\n");
+	fprintf(stderr, "  -c nr_hot  request only the nr_hot most popular "
+		"files, after fetching\n"
+		"             each of them once before the timer starts. "
+		"measures cache hits\n");
+	fprintf(stderr, "  -k depth   make all the requests of a thread on one "
+		"persistent connection,\n"
+		"             with up to depth of them pipelined\n");
+	fprintf(stderr, "  -g         accept gzipped bodies, and check them "
+		"once decompressed\n");
 	exit(1);
 }
 
@@ -190,16 +347,36 @@ main(int argc, char *argv[])
 	struct client cl;
 	struct timeval start, end, diff;
 
-	if (argc != 6 && argc != 7) {
-		usage(argv[0]);
+	cl.timing_mode = 0;
+	cl.nr_hot = 0;
+	cl.depth = 0;
+	cl.gzip = 0;
+	while ((i = getopt(argc, argv, "tc:k:g")) != -1) {
+		switch (i) {
+		case 't':
+			cl.timing_mode = 1;
+			break;
+		case 'c':
+			cl.nr_hot = atoi(optarg);
+			if (cl.nr_hot <= 0)
+				usage(argv[0]);
+			break;
+		case 'k':
+			cl.depth = atoi(optarg);
+			if (cl.depth <= 0)
+				usage(argv[0]);
+			break;
+		case 'g':
+			cl.gzip = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
 	}
-	i = 1;
-	if (strcmp(argv[i], "-t") == 0) {
-		cl.timing_mode = 1;
-		i++;
-	} else {
-		cl.timing_mode = 0;
+	if (argc - optind != 5) {
+		usage(argv[0]);
 	}
+	i = optind;
 	cl.host = argv[i++];
 	cl.port = atoi(argv[i++]);
 	cl.nr_times = atoi(argv[i++]);
@@ -211,6 +388,12 @@ main(int argc, char *argv[])
 	}
 
 	init_fileset(filename, &cl);
+	if (cl.nr_hot > cl.nr_files) {
+		cl.nr_hot = cl.nr_files;
+	}
+	if (cl.nr_hot) {
+		client_warm(&cl);
+	}
 
 	if (cl.timing_mode)
 		gettimeofday(&start, NULL);
@@ -13,10 +13,15 @@ unix_error(char *msg)
 /*********************************************
  * Wrappers for memory management functions
  ********************************************/
+
+/* the number of Malloc calls made by this thread */
+static __thread unsigned long malloc_calls;
+
 void *
 Malloc(size_t size)
 {
 	void *rc;
+	malloc_calls++;
 	rc = malloc(size);
 	if (!rc) {
 		unix_error("malloc");
@@ -24,6 +29,62 @@ Malloc(size_t size)
 	return rc;
 }
 
+unsigned long
+Malloc_calls(void)
+{
+	return malloc_calls;
+}
+
+/*********************************************
+ * Reading mapped files
+ ********************************************/
+
+/* where the SIGBUS handler jumps to, while this thread is in map_guard */
+static __thread sigjmp_buf *map_guard_env;
+static pthread_once_t map_guard_once = PTHREAD_ONCE_INIT;
+
+static void
+map_guard_sigbus(int sig)
+{
+	if (!map_guard_env) {
+		/* not reading a mapping, the fault comes back and kills us */
+		signal(sig, SIG_DFL);
+		return;
+	}
+	siglongjmp(*map_guard_env, 1);
+}
+
+/* SA_NODEFER leaves the signal unblocked after the jump, so that map_guard
+ * need not save the signal mask on every call */
+static void
+map_guard_init(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = map_guard_sigbus;
+	sa.sa_flags = SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	SYS(sigaction(SIGBUS, &sa, NULL));
+}
+
+int
+map_guard(void (*fn)(void *arg), void *arg)
+{
+	sigjmp_buf env, *prev;
+
+	pthread_once(&map_guard_once, map_guard_init);
+	prev = map_guard_env;
+	if (sigsetjmp(env, 0)) {
+		map_guard_env = prev;
+		return -1;
+	}
+	map_guard_env = &env;
+	fn(arg);
+	map_guard_env = prev;
+	return 0;
+}
+
 /*********************************************************************
  * The Rio package - robust I/O functions
  **********************************************************************/
@@ -138,14 +199,15 @@ rio_readb(struct rio *rp, char *usrbuf, size_t n)
 	return cnt;
 }
 
-/* rio_readlineb - robustly read a text line (buffered) */
+/* rio_readlineb - robustly read a text line (buffered), of at most maxlen - 1
+ * bytes so that the terminating NUL fits */
 static ssize_t
 rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen)
 {
 	int n, rc;
 	char c, *bufp = usrbuf;
 
-	for (n = 0; n < maxlen; n++) {
+	for (n = 0; n < maxlen - 1; n++) {
 		if ((rc = rio_readb(rp, &c, 1)) == 1) {
 			*bufp++ = c;
 			if (c == '\n') {
@@ -164,6 +226,25 @@ rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen)
 	return n;
 }
 
+/* rio_readnb - robustly read n bytes (buffered) */
+static ssize_t
+rio_readnb(struct rio *rp, void *usrbuf, size_t n)
+{
+	size_t nleft = n;
+	ssize_t nread;
+	char *bufp = usrbuf;
+
+	while (nleft > 0) {
+		if ((nread = rio_readb(rp, bufp, nleft)) < 0)
+			return -1;	/* errno set by read() */
+		else if (nread == 0)
+			break;	/* EOF */
+		nleft -= nread;
+		bufp += nread;
+	}
+	return (n - nleft);	/* return >= 0 */
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -209,6 +290,16 @@ Rio_readlineb(struct rio * rp, void *usrbuf, size_t maxlen)
 	return rc;
 }
 
+ssize_t
+Rio_readnb(struct rio *rp, void *usrbuf, size_t n)
+{
+	ssize_t rc;
+
+	if ((rc = rio_readnb(rp, usrbuf, n)) < 0)
+		unix_error("Rio_readnb error");
+	return rc;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -238,9 +329,10 @@ open_clientfd(char *hostname, int port)
 	return clientfd;
 }
 
-/* open and return a listening socket on port */
+/* open and return a listening socket on port, which other sockets may share
+ * if reuseport is set */
 int
-open_listenfd(int port)
+open_listenfd(int port, int reuseport)
 {
 	int listenfd, optval = 1;
 	struct sockaddr_in serveraddr;
@@ -252,6 +344,13 @@ open_listenfd(int port)
 	SYS(setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
 		       (const void *)&optval, sizeof(int)));
 
+	/* Lets several sockets listen on the port, the kernel spreads the
+	   incoming connections over them */
+	if (reuseport) {
+		SYS(setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+			       (const void *)&optval, sizeof(int)));
+	}
+
 	/* Listenfd will be an endpoint for all requests to port
 	   on any IP address for this host */
 	bzero((char *)&serveraddr, sizeof(serveraddr));
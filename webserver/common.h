@@ -15,6 +15,11 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/resource.h>
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
@@ -61,8 +66,19 @@
 #define MAXBUF   8192	/* max I/O buffer size */
 #define LISTENQ  1024	/* second argument to listen() */
 
+/* Error-handling functions */
+void unix_error(char *msg);
+
 /* Memory managment wrappers */
 void *Malloc(size_t size);
+/* returns how many times the calling thread has called Malloc */
+unsigned long Malloc_calls(void);
+
+/* Reading mapped files. a file that is truncated on disk while it is mapped
+ * raises SIGBUS when the pages past its new end are read. map_guard runs
+ * fn(arg) and returns 0, or -1 if it raised SIGBUS. fn is cut short, so it
+ * must not take locks or allocate memory */
+int map_guard(void (*fn)(void *arg), void *arg);
 
 /* Persistent state for the robust I/O (Rio) package */
 struct rio;
@@ -72,10 +88,11 @@ void Rio_destroy(struct rio *rp);
 ssize_t Rio_read(int fd, void *usrbuf, size_t n);
 void Rio_write(int fd, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(struct rio *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_readnb(struct rio *rp, void *usrbuf, size_t n);
 
 /* Wrappers for client/server helper functions */
 int open_clientfd(char *hostname, int port);
-int open_listenfd(int port);
+int open_listenfd(int port, int reuseport);
 
 /* Random functions */
 void init_random();
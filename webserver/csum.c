@@ -0,0 +1,139 @@
+#include "csum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSUM_X86
+#endif
+
+static int
+always(void)
+{
+	return 1;
+}
+
+static unsigned int
+csum_scalar(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	unsigned int sum = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		sum += p[i];
+	}
+	return sum;
+}
+
+#ifdef CSUM_X86
+
+/* psadbw against zero adds up each group of 8 bytes into a 64 bit lane, which
+ * cannot overflow, so the lanes only need to be added up at the end. several
+ * accumulators keep the adds from waiting on each other. */
+
+__attribute__((target("sse2")))
+static unsigned int
+csum_sse2(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i s0 = zero, s1 = zero, s2 = zero, s3 = zero;
+	unsigned long long lanes[2];
+	size_t i = 0;
+
+	for (; i + 64 <= len; i += 64) {
+		s0 = _mm_add_epi64(s0, _mm_sad_epu8(
+			_mm_loadu_si128((const __m128i *)(p + i)), zero));
+		s1 = _mm_add_epi64(s1, _mm_sad_epu8(
+			_mm_loadu_si128((const __m128i *)(p + i + 16)), zero));
+		s2 = _mm_add_epi64(s2, _mm_sad_epu8(
+			_mm_loadu_si128((const __m128i *)(p + i + 32)), zero));
+		s3 = _mm_add_epi64(s3, _mm_sad_epu8(
+			_mm_loadu_si128((const __m128i *)(p + i + 48)), zero));
+	}
+	for (; i + 16 <= len; i += 16) {
+		s0 = _mm_add_epi64(s0, _mm_sad_epu8(
+			_mm_loadu_si128((const __m128i *)(p + i)), zero));
+	}
+	s0 = _mm_add_epi64(_mm_add_epi64(s0, s1), _mm_add_epi64(s2, s3));
+	_mm_storeu_si128((__m128i *)lanes, s0);
+	return (unsigned int)(lanes[0] + lanes[1]) +
+		csum_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static unsigned int
+csum_avx2(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i s0 = zero, s1 = zero, s2 = zero, s3 = zero;
+	unsigned long long lanes[4];
+	size_t i = 0;
+
+	for (; i + 128 <= len; i += 128) {
+		s0 = _mm256_add_epi64(s0, _mm256_sad_epu8(
+			_mm256_loadu_si256((const __m256i *)(p + i)), zero));
+		s1 = _mm256_add_epi64(s1, _mm256_sad_epu8(
+			_mm256_loadu_si256((const __m256i *)(p + i + 32)), zero));
+		s2 = _mm256_add_epi64(s2, _mm256_sad_epu8(
+			_mm256_loadu_si256((const __m256i *)(p + i + 64)), zero));
+		s3 = _mm256_add_epi64(s3, _mm256_sad_epu8(
+			_mm256_loadu_si256((const __m256i *)(p + i + 96)), zero));
+	}
+	for (; i + 32 <= len; i += 32) {
+		s0 = _mm256_add_epi64(s0, _mm256_sad_epu8(
+			_mm256_loadu_si256((const __m256i *)(p + i)), zero));
+	}
+	s0 = _mm256_add_epi64(_mm256_add_epi64(s0, s1),
+			      _mm256_add_epi64(s2, s3));
+	_mm256_storeu_si256((__m256i *)lanes, s0);
+	return (unsigned int)(lanes[0] + lanes[1] + lanes[2] + lanes[3]) +
+		csum_scalar(p + i, len - i);
+}
+
+static int
+has_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static int
+has_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+#endif /* CSUM_X86 */
+
+const struct csum_impl csum_impls[] = {
+#ifdef CSUM_X86
+	{ "avx2", csum_avx2, has_avx2 },
+	{ "sse2", csum_sse2, has_sse2 },
+#endif
+	{ "scalar", csum_scalar, always },
+	{ NULL, NULL, NULL },
+};
+
+const struct csum_impl *csum_impl = NULL;
+
+/* picks the implementation before main runs, so that csum_buf never has to
+ * check whether it has been picked */
+__attribute__((constructor))
+static void
+csum_init(void)
+{
+	const struct csum_impl *impl;
+
+#ifdef CSUM_X86
+	__builtin_cpu_init();
+#endif
+	for (impl = csum_impls; !impl->supported(); impl++)
+		;
+	csum_impl = impl;
+}
+
+unsigned int
+csum_buf(const void *buf, size_t len)
+{
+	return csum_impl->csum(buf, len);
+}
@@ -0,0 +1,22 @@
+#ifndef __CSUM_H__
+#define __CSUM_H__
+
+#include <stddef.h>
+
+/* the Content-Csum of a response: the sum of its bytes, as unsigned chars,
+ * modulo 2^32. since the sum is modular, the checksum of a message sent in
+ * pieces is the sum of the checksums of the pieces. */
+unsigned int csum_buf(const void *buf, size_t len);
+
+/* csum_buf uses the fastest of these that the cpu supports, they all return
+ * the same result. the list ends with the portable scalar version. */
+struct csum_impl {
+	const char *name;
+	unsigned int (*csum)(const void *buf, size_t len);
+	int (*supported)(void);
+};
+
+extern const struct csum_impl csum_impls[];
+extern const struct csum_impl *csum_impl;	/* the one csum_buf uses */
+
+#endif /* __CSUM_H__ */
@@ -0,0 +1,81 @@
+/*
+ * csum_bench.c: measures the throughput of the checksum implementations.
+ *
+ * To run:
+ *  csum_bench [total_mb]
+ *
+ * For file sizes from 4 KB to 64 MB, checksums a buffer of that size with
+ * every implementation the cpu supports until total_mb megabytes (256 by
+ * default) have been summed, and prints GB/s. Also checks that all of them
+ * agree with the scalar version.
+ */
+
+#include "common.h"
+#include "csum.h"
+
+#define MIN_SIZE (4 << 10)
+#define MAX_SIZE (64 << 20)
+#define DEFAULT_TOTAL_MB 256
+
+int
+main(int argc, char *argv[])
+{
+	const struct csum_impl *impl, *scalar;
+	unsigned char *buf;
+	long total;
+	size_t size;
+	int i;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [total_mb]\n", argv[0]);
+		exit(1);
+	}
+	total = (argc == 2 ? atol(argv[1]) : DEFAULT_TOTAL_MB) << 20;
+	assert(total > 0);
+
+	buf = Malloc(MAX_SIZE);
+	for (i = 0; i < MAX_SIZE; i++) {
+		buf[i] = random();
+	}
+	for (scalar = csum_impls; scalar[1].name; scalar++)
+		;
+
+	printf("csum_buf uses %s\n", csum_impl->name);
+	printf("%10s", "size");
+	for (impl = csum_impls; impl->name; impl++) {
+		if (impl->supported())
+			printf(" %10s", impl->name);
+	}
+	printf("   (GB/s)\n");
+
+	for (size = MIN_SIZE; size <= MAX_SIZE; size *= 4) {
+		/* an odd offset, so that the tail and unaligned loads are
+		 * checked too */
+		const unsigned char *p = buf + (size < MAX_SIZE ? 1 : 0);
+		size_t len = size < MAX_SIZE ? size - 1 : size;
+		unsigned int expected = scalar->csum(p, len);
+
+		printf("%9zuK", size >> 10);
+		for (impl = csum_impls; impl->name; impl++) {
+			struct timeval start, end, diff;
+			volatile unsigned int sum;
+			long done;
+			double sec;
+
+			if (!impl->supported())
+				continue;
+			assert(impl->csum(p, len) == expected);
+			gettimeofday(&start, NULL);
+			for (done = 0; done < total; done += len) {
+				sum = impl->csum(p, len);
+			}
+			gettimeofday(&end, NULL);
+			(void)sum;
+			timersub(&end, &start, &diff);
+			sec = diff.tv_sec + diff.tv_usec / 1e6;
+			printf(" %10.2f", done / sec / 1e9);
+		}
+		printf("\n");
+	}
+	exit(0);
+}
@@ -0,0 +1,10 @@
+#include "debug.h"
+
+pthread_t *threads;
+
+int pthread_t_to_small_int(pthread_t pt)
+{
+	int i = 0;
+	while (threads[i++] != pt);
+	return i;
+}
@@ -0,0 +1,29 @@
+#ifndef __DEBUG_H__
+#define __DEBUG_H__
+
+#include <pthread.h>
+
+/* debug */
+extern pthread_t *threads;	/* worker threads, set up by server_init */
+int pthread_t_to_small_int(pthread_t pt);
+#define ZEROING_FREE(X)                         \
+    if (X) memset(X, 0, sizeof(*X));            \
+    free(X);                                    \
+    X = NULL;
+#define ZEROING_FREE_STR(X)                     \
+    if (X) memset(X, 0, strlen(X));             \
+    free(X);                                    \
+    X = NULL;
+
+#ifdef DEBUG
+#define DEBUG_PRINT(FMT, ...)											\
+printf("%d|" FMT "\n", pthread_t_to_small_int(pthread_self()), __VA_ARGS__)
+#define FREE(X) ZEROING_FREE(X)
+#define FREE_STR(X) ZEROING_FREE_STR(X)
+#else
+#define DEBUG_PRINT(FMT, ...)
+#define FREE(X) free(X)
+#define FREE_STR(X) free(X)
+#endif
+
+#endif /* __DEBUG_H__ */
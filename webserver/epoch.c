@@ -0,0 +1,119 @@
+#include "common.h"
+#include "epoch.h"
+
+/* each thread has a record that says whether it is in a critical section and
+ * which global epoch it saw when it entered. the global epoch only advances
+ * once every thread in a critical section has seen the current one, so an
+ * object retired in epoch e can be freed once the global epoch reaches e + 2.
+ * retired objects wait on one of three limbo lists, one per epoch mod 3. */
+
+struct epoch_record {
+	unsigned long epoch;
+	int active;
+	struct epoch_record *next;
+};
+
+struct retired {
+	void *p;
+	void (*free_fn)(void *);
+	struct retired *next;
+};
+
+static unsigned long global_epoch = 0;
+static struct epoch_record *records = NULL;
+static pthread_mutex_t records_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* limbo lists are only used by writers, which are rare */
+static struct retired *limbo[3] = { NULL, NULL, NULL };
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct epoch_record *my_record = NULL;
+
+static struct epoch_record *
+epoch_register(void)
+{
+	struct epoch_record *r = Malloc(sizeof(struct epoch_record));
+
+	r->epoch = 0;
+	r->active = 0;
+	pthread_mutex_lock(&records_lock);
+	r->next = records;
+	__atomic_store_n(&records, r, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&records_lock);
+	return r;
+}
+
+void
+epoch_enter(void)
+{
+	struct epoch_record *r = my_record;
+
+	if (!r)
+		r = my_record = epoch_register();
+	__atomic_store_n(&r->epoch, __atomic_load_n(&global_epoch,
+						    __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&r->active, 1, __ATOMIC_RELAXED);
+	/* our record must be visible before we read any shared pointer. if
+	 * the epoch we saw is already stale, the global epoch cannot advance
+	 * past it until we exit */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+epoch_exit(void)
+{
+	__atomic_store_n(&my_record->active, 0, __ATOMIC_RELEASE);
+}
+
+static void
+free_list(struct retired *r)
+{
+	while (r) {
+		struct retired *next = r->next;
+		r->free_fn(r->p);
+		free(r);
+		r = next;
+	}
+}
+
+/* advances the global epoch if every active thread has seen it, and returns
+ * the objects that are now safe to free. called with limbo_lock held. */
+static struct retired *
+epoch_try_advance(void)
+{
+	struct epoch_record *r;
+	unsigned long e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+	struct retired *reclaim;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (r = __atomic_load_n(&records, __ATOMIC_ACQUIRE); r; r = r->next) {
+		if (__atomic_load_n(&r->active, __ATOMIC_ACQUIRE) &&
+		    __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE) != e)
+			return NULL;
+	}
+	/* nobody is in epoch e - 1 anymore, so the objects retired in e - 2
+	 * (which share a list with the ones that will be retired in e + 1)
+	 * are unreachable */
+	__atomic_store_n(&global_epoch, e + 1, __ATOMIC_RELEASE);
+	reclaim = limbo[(e + 1) % 3];
+	limbo[(e + 1) % 3] = NULL;
+	return reclaim;
+}
+
+void
+epoch_retire(void *p, void (*free_fn)(void *))
+{
+	struct retired *r = Malloc(sizeof(struct retired));
+	struct retired *reclaim;
+
+	r->p = p;
+	r->free_fn = free_fn;
+	pthread_mutex_lock(&limbo_lock);
+	r->next = limbo[__atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) % 3];
+	limbo[global_epoch % 3] = r;
+	reclaim = epoch_try_advance();
+	pthread_mutex_unlock(&limbo_lock);
+
+	free_list(reclaim);
+}
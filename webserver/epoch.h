@@ -0,0 +1,14 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+/* epoch based reclamation. readers bracket lock free traversals with
+ * epoch_enter() and epoch_exit(). writers unlink objects and hand them to
+ * epoch_retire(), which frees them once every thread that might still be
+ * looking at them has left its critical section. critical sections must be
+ * short and must not block. */
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *p, void (*free_fn)(void *));
+
+#endif /* __EPOCH_H__ */
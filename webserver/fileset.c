@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <popt.h>
 #include "common.h"
+#include "csum.h"
 
 /* Generate a set of files for the webserver assignment */
 
@@ -114,8 +115,8 @@ main(int argc, const char *argv[])
 			for (j = 0; j < sz; j++) {
 				/* printable characters lie between 0x20-0x73 */
 				buf[j] = random() % (0x73 - 0x20) + 0x20;
-				csum += (unsigned char)(buf[j]);
 			}
+			csum += csum_buf(buf, sz);
 			Rio_write(fd, buf, sz);
 			remaining -= sz;
 		}
@@ -0,0 +1,134 @@
+#include "common.h"
+#include "http.h"
+
+void
+http_parser_init(struct http_parser *p)
+{
+	p->scanned = 0;
+	p->line = 0;
+	p->request_line = 0;
+	p->method.off = p->uri.off = p->version.off = 0;
+	p->method.len = p->uri.len = p->version.len = 0;
+	p->nr_headers = 0;
+}
+
+static int
+http_blank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+/* fills s with the word at buf[*pos], up to the next blank or end, and moves
+ * *pos past the blanks that follow it */
+static void
+http_word(const char *buf, int *pos, int end, struct http_slice *s)
+{
+	int i = *pos;
+
+	s->off = i;
+	while (i < end && !http_blank(buf[i]))
+		i++;
+	s->len = i - s->off;
+	while (i < end && http_blank(buf[i]))
+		i++;
+	*pos = i;
+}
+
+/* the request line: method, uri and version, separated by blanks. missing
+ * parts are left empty */
+static void
+http_parse_request_line(struct http_parser *p, const char *buf, int start,
+			int end)
+{
+	int pos = start;
+
+	while (pos < end && http_blank(buf[pos]))
+		pos++;
+	http_word(buf, &pos, end, &p->method);
+	http_word(buf, &pos, end, &p->uri);
+	http_word(buf, &pos, end, &p->version);
+	p->request_line = 1;
+}
+
+/* a header line, "name: value". lines without a colon are skipped */
+static void
+http_parse_header(struct http_parser *p, const char *buf, int start, int end)
+{
+	struct http_header *h;
+	const char *colon;
+	int pos;
+
+	if (p->nr_headers == HTTP_MAX_HEADERS)
+		return;
+	colon = memchr(buf + start, ':', end - start);
+	if (!colon)
+		return;
+	h = &p->headers[p->nr_headers++];
+	h->name.off = start;
+	h->name.len = colon - (buf + start);
+	pos = colon - buf + 1;
+	while (pos < end && http_blank(buf[pos]))
+		pos++;
+	while (end > pos && http_blank(buf[end - 1]))
+		end--;
+	h->value.off = pos;
+	h->value.len = end - pos;
+}
+
+/* parses what has not been parsed yet of the len bytes of the request head
+ * in buf. lines end with CRLF, or a bare LF. returns the length of the head,
+ * up to and including the empty line that ends it, once all of it is in buf,
+ * or 0 if more of it is needed. empty lines before the request line are
+ * skipped. buf may move between calls, since p only holds offsets, but its
+ * contents must not change */
+int
+http_parse(struct http_parser *p, const char *buf, int len)
+{
+	const char *nl;
+	int end;
+
+	/* memchr looks at many bytes at once */
+	while ((nl = memchr(buf + p->scanned, '\n', len - p->scanned))) {
+		end = nl - buf;
+		p->scanned = end + 1;
+		if (end > p->line && buf[end - 1] == '\r')
+			end--;
+		if (end == p->line) {
+			/* an empty line */
+			if (p->request_line)
+				return p->scanned;
+		} else if (!p->request_line) {
+			http_parse_request_line(p, buf, p->line, end);
+		} else {
+			http_parse_header(p, buf, p->line, end);
+		}
+		p->line = p->scanned;
+	}
+	p->scanned = len;
+	return 0;
+}
+
+/* whether s holds str */
+int
+http_slice_is(const struct http_slice *s, const char *buf, const char *str)
+{
+	return s->len == strlen(str) && !memcmp(buf + s->off, str, s->len);
+}
+
+/* returns the value of the first header called name, which is compared
+ * without regard to case, or NULL if there is none */
+const struct http_slice *
+http_header(const struct http_parser *p, const char *buf, const char *name)
+{
+	int len = strlen(name);
+	int i;
+
+	for (i = 0; i < p->nr_headers; i++) {
+		const struct http_header *h = &p->headers[i];
+
+		if (h->name.len == len &&
+		    !strncasecmp(buf + h->name.off, name, len))
+			return &h->value;
+	}
+	return NULL;
+}
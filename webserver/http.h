@@ -0,0 +1,41 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+/* an incremental parser for HTTP request heads. the head is parsed where it
+ * lies, in the caller's buffer: the parser copies nothing and allocates
+ * nothing, it only records where the parts of the head are, as offsets into
+ * the buffer. the caller appends to the buffer as data arrives and calls
+ * http_parse again, which carries on from where it stopped, so each byte is
+ * only looked at once. */
+
+#define HTTP_MAX_HEADERS 32	/* more header lines are skipped */
+
+/* len bytes at offset off in the buffer */
+struct http_slice {
+	int off;
+	int len;
+};
+
+struct http_header {
+	struct http_slice name;
+	struct http_slice value;	/* without the leading and trailing
+					 * blanks */
+};
+
+struct http_parser {
+	int scanned;		/* bytes of the buffer looked at so far */
+	int line;		/* where the current line starts */
+	int request_line;	/* the request line has been parsed */
+	struct http_slice method, uri, version;
+	int nr_headers;
+	struct http_header headers[HTTP_MAX_HEADERS];
+};
+
+void http_parser_init(struct http_parser *p);
+int http_parse(struct http_parser *p, const char *buf, int len);
+int http_slice_is(const struct http_slice *s, const char *buf,
+		  const char *str);
+const struct http_slice *http_header(const struct http_parser *p,
+				     const char *buf, const char *name);
+
+#endif /* __HTTP_H__ */
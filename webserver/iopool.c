@@ -0,0 +1,76 @@
+#include "common.h"
+#include "iopool.h"
+
+struct iopool {
+	int nr_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	struct list_head jobs;		/* submitted, not run yet, under lock */
+	unsigned depth;			/* on jobs */
+	unsigned max_depth;		/* the most queued at once */
+	unsigned long submitted;
+};
+
+static void *
+iopool_thread(void *p_v)
+{
+	struct iopool *p = (struct iopool *)p_v;
+	struct iopool_job *job;
+
+	while (1) {
+		pthread_mutex_lock(&p->lock);
+		while (list_empty(&p->jobs)) {
+			pthread_cond_wait(&p->not_empty, &p->lock);
+		}
+		job = list_first_entry(&p->jobs, struct iopool_job, list);
+		list_del(&job->list);
+		p->depth--;
+		pthread_mutex_unlock(&p->lock);
+
+		job->run(job);
+	}
+	return NULL;
+}
+
+struct iopool *
+iopool_init(int nr_threads)
+{
+	struct iopool *p;
+	pthread_t t;
+	int i;
+
+	assert(nr_threads > 0);
+	p = Malloc(sizeof(struct iopool));
+	p->nr_threads = nr_threads;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->not_empty, NULL);
+	INIT_LIST_HEAD(&p->jobs);
+	p->depth = p->max_depth = 0;
+	p->submitted = 0;
+	for (i = 0; i < nr_threads; i++) {
+		SYS(pthread_create(&t, NULL, iopool_thread, p));
+	}
+	return p;
+}
+
+/* the job must stay alive until it has run */
+void
+iopool_submit(struct iopool *p, struct iopool_job *job)
+{
+	pthread_mutex_lock(&p->lock);
+	list_add_tail(&job->list, &p->jobs);
+	if (++p->depth > p->max_depth)
+		p->max_depth = p->depth;
+	p->submitted++;
+	pthread_cond_signal(&p->not_empty);
+	pthread_mutex_unlock(&p->lock);
+}
+
+void
+iopool_stats(struct iopool *p, FILE *out)
+{
+	pthread_mutex_lock(&p->lock);
+	fprintf(out, "I/O threads = %d, jobs = %lu, most queued = %u\n",
+		p->nr_threads, p->submitted, p->max_depth);
+	pthread_mutex_unlock(&p->lock);
+}
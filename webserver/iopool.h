@@ -0,0 +1,23 @@
+#ifndef __IOPOOL_H__
+#define __IOPOOL_H__
+
+#include <stdio.h>
+#include "list.h"
+
+/* a pool of threads for work that blocks on the disk, e.g. reading a file
+ * that missed in the cache, so that the threads serving the connections can
+ * get on with the others meanwhile. the job is embedded in whatever it works
+ * on, so submitting one never allocates. its run function is called on one
+ * of the pool's threads, and hands the result back to the submitter itself */
+struct iopool_job {
+	void (*run)(struct iopool_job *job);
+	struct list_head list;	/* on the pool's queue */
+};
+
+struct iopool;
+
+struct iopool *iopool_init(int nr_threads);
+void iopool_submit(struct iopool *p, struct iopool_job *job);
+void iopool_stats(struct iopool *p, FILE *out);
+
+#endif /* __IOPOOL_H__ */
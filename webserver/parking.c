@@ -0,0 +1,51 @@
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "common.h"
+#include "parking.h"
+
+void
+parking_init(struct parking *p)
+{
+	p->seq = 0;
+	p->waiters = 0;
+}
+
+/* returns the seq to pass to parking_wait */
+unsigned int
+parking_prepare(struct parking *p)
+{
+	unsigned int seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+
+	/* ordered before the caller looks again at what it waits for */
+	__atomic_add_fetch(&p->waiters, 1, __ATOMIC_SEQ_CST);
+	return seq;
+}
+
+void
+parking_wait(struct parking *p, unsigned int seq)
+{
+	/* returns at once if seq has moved on, i.e. the thread was woken since
+	 * parking_prepare. spurious wake ups are fine */
+	syscall(SYS_futex, &p->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+}
+
+void
+parking_done(struct parking *p)
+{
+	__atomic_sub_fetch(&p->waiters, 1, __ATOMIC_RELAXED);
+}
+
+/* wakes up a thread parked on p, if there is one */
+void
+parking_wake(struct parking *p)
+{
+	/* orders the caller's change before reading waiters. a parking thread
+	 * orders its increment of waiters before looking at the change, so
+	 * either it sees the change or we see it */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&p->waiters, __ATOMIC_RELAXED) > 0) {
+		__atomic_add_fetch(&p->seq, 1, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &p->seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL,
+			0);
+	}
+}
@@ -0,0 +1,23 @@
+#ifndef __PARKING_H__
+#define __PARKING_H__
+
+/* a place where threads wait for something to change, e.g. for a queue to
+ * stop being empty, by parking on a futex. a thread that changes it calls
+ * parking_wake, which only makes a system call if a thread is parked.
+ *
+ * to wait, a thread calls parking_prepare, checks once more whether it still
+ * has to wait, calls parking_wait if so, and then parking_done. a change made
+ * after the check is not missed: either the thread sees it, or parking_wake
+ * sees the thread and parking_wait returns at once. */
+struct parking {
+	unsigned int seq;	/* bumped by every wake */
+	unsigned int waiters;	/* threads between prepare and done */
+} __attribute__((aligned(64)));
+
+void parking_init(struct parking *p);
+unsigned int parking_prepare(struct parking *p);
+void parking_wait(struct parking *p, unsigned int seq);
+void parking_done(struct parking *p);
+void parking_wake(struct parking *p);
+
+#endif /* __PARKING_H__ */
@@ -0,0 +1,704 @@
+/*
+ * policy.c: eviction policies for the file cache.
+ *
+ * Each cache shard keeps its own policy state. Sizes are in bytes, because
+ * cached files vary a lot in size, so the size based policies (ARC,
+ * W-TinyLFU) compare byte counts instead of entry counts.
+ */
+
+#include "common.h"
+#include "request.h"
+#include "cache.h"
+#include "policy.h"
+#include "sketch.h"
+
+#define NODE_SIZE(n) ((n)->size)
+/* the frequency sketch counts no higher, see sketch.h */
+#define SKETCH_MAX 15
+
+/* returns the hits found on n without the lock that the policy has not taken
+ * in yet, see cache_touch_nolock(), and marks them taken in. a victim does
+ * not get evicted if it has any, it is touched and another one is looked for,
+ * as if the hits had been seen on time. the first victim to be touched is
+ * taken the second time around, every node has been touched by then */
+static unsigned long
+policy_pending(node *n)
+{
+	unsigned long hits = __atomic_load_n(&n->hits, __ATOMIC_RELAXED);
+	unsigned long pending = hits - n->seen;
+
+	n->seen = hits;
+	return pending;
+}
+
+/* returns the least recently used node on list, or NULL if it is empty */
+static node *
+oldest(struct list_head *list)
+{
+	if (list_empty(list))
+		return NULL;
+	return list_first_entry(list, node, list);
+}
+
+/*
+ * LRU: one list, least recently used first.
+ */
+
+struct lru {
+	struct list_head list;
+};
+
+static void *
+lru_init(unsigned max_size)
+{
+	struct lru *st = Malloc(sizeof(struct lru));
+	INIT_LIST_HEAD(&st->list);
+	return st;
+}
+
+static void
+lru_insert(void *st_v, node *n)
+{
+	struct lru *st = st_v;
+	list_add_tail(&n->list, &st->list);
+}
+
+static void
+lru_touch(void *st_v, node *n)
+{
+	struct lru *st = st_v;
+	list_del(&n->list);
+	list_add_tail(&n->list, &st->list);
+}
+
+static void
+lru_miss(void *st_v, unsigned long hash)
+{
+}
+
+static node *
+lru_victim(void *st_v)
+{
+	struct lru *st = st_v;
+	node *n, *first = NULL;
+
+	while ((n = oldest(&st->list)) && n != first && policy_pending(n)) {
+		if (!first)
+			first = n;
+		lru_touch(st, n);
+	}
+	return n;
+}
+
+static void
+lru_remove(void *st_v, node *n)
+{
+	list_del(&n->list);
+}
+
+static const struct cache_policy lru_policy = {
+	"lru", lru_init, lru_insert, lru_touch, lru_miss, lru_victim,
+	lru_remove,
+};
+
+/*
+ * CLOCK: second chance. n->freq is the reference bit, set on every hit, or
+ * once the hand finds hits on n that were made without the lock. The hand sits
+ * at the head of the list: a referenced node gets its bit cleared and goes to
+ * the tail, the first unreferenced node is the victim.
+ */
+
+struct clock {
+	struct list_head list;
+	unsigned nr_nodes;
+};
+
+static void *
+clock_init(unsigned max_size)
+{
+	struct clock *st = Malloc(sizeof(struct clock));
+	INIT_LIST_HEAD(&st->list);
+	st->nr_nodes = 0;
+	return st;
+}
+
+static void
+clock_insert(void *st_v, node *n)
+{
+	struct clock *st = st_v;
+	n->freq = 0;
+	list_add_tail(&n->list, &st->list);
+	st->nr_nodes++;
+}
+
+static void
+clock_touch(void *st_v, node *n)
+{
+	n->freq = 1;
+}
+
+static node *
+clock_victim(void *st_v)
+{
+	struct clock *st = st_v;
+	unsigned i;
+
+	/* one sweep clears every reference bit, so the second one finds a
+	 * victim, unless hits without the lock set them again meanwhile */
+	for (i = 0; i < 2 * st->nr_nodes; i++) {
+		node *n = list_first_entry(&st->list, node, list);
+		if (policy_pending(n))
+			n->freq = 1;
+		if (!n->freq)
+			return n;
+		n->freq = 0;
+		list_del(&n->list);
+		list_add_tail(&n->list, &st->list);
+	}
+	return oldest(&st->list);
+}
+
+static void
+clock_remove(void *st_v, node *n)
+{
+	struct clock *st = st_v;
+	list_del(&n->list);
+	st->nr_nodes--;
+}
+
+static const struct cache_policy clock_policy = {
+	"clock", clock_init, clock_insert, clock_touch, lru_miss, clock_victim,
+	clock_remove,
+};
+
+/*
+ * LFU: O(1) least frequently used. Nodes with the same use count hang off a
+ * frequency bucket, buckets are kept in increasing order of use count and
+ * n->policy_data points to n's bucket. Ties are broken by recency.
+ */
+
+struct lfu_bucket {
+	unsigned freq;
+	struct list_head nodes;	/* least recently used first */
+	struct list_head list;	/* position in lfu->buckets */
+};
+
+struct lfu {
+	struct list_head buckets;
+	struct list_head spares;	/* emptied buckets, for reuse, so that
+					 * hits make no heap calls */
+};
+
+static void *
+lfu_init(unsigned max_size)
+{
+	struct lfu *st = Malloc(sizeof(struct lfu));
+	INIT_LIST_HEAD(&st->buckets);
+	INIT_LIST_HEAD(&st->spares);
+	return st;
+}
+
+/* returns the bucket for freq that comes right after prev (which may be the
+ * list head), creating it if needed */
+static struct lfu_bucket *
+lfu_bucket_after(struct lfu *st, struct list_head *prev, unsigned freq)
+{
+	struct lfu_bucket *b;
+
+	if (prev->next != &st->buckets) {
+		b = list_entry(prev->next, struct lfu_bucket, list);
+		if (b->freq == freq)
+			return b;
+	}
+	if (!list_empty(&st->spares)) {
+		b = list_first_entry(&st->spares, struct lfu_bucket, list);
+		list_del(&b->list);
+	} else {
+		b = Malloc(sizeof(struct lfu_bucket));
+	}
+	b->freq = freq;
+	INIT_LIST_HEAD(&b->nodes);
+	__list_add(&b->list, prev, prev->next);
+	return b;
+}
+
+static void
+lfu_unlink(struct lfu *st, node *n)
+{
+	struct lfu_bucket *b = n->policy_data;
+
+	list_del(&n->list);
+	if (list_empty(&b->nodes)) {
+		list_del(&b->list);
+		list_add(&b->list, &st->spares);
+	}
+}
+
+static void
+lfu_insert(void *st_v, node *n)
+{
+	struct lfu *st = st_v;
+	struct lfu_bucket *b = lfu_bucket_after(st, &st->buckets, 1);
+
+	n->freq = 1;
+	n->policy_data = b;
+	list_add_tail(&n->list, &b->nodes);
+}
+
+/* counts hits more uses of n */
+static void
+lfu_add(struct lfu *st, node *n, unsigned long hits)
+{
+	struct lfu_bucket *b = n->policy_data;
+	struct lfu_bucket *next;
+	struct list_head *prev = &b->list;
+
+	n->freq += hits;
+	/* the buckets in between, if more than one use is added */
+	while (prev->next != &st->buckets &&
+	       list_entry(prev->next, struct lfu_bucket, list)->freq < n->freq)
+		prev = prev->next;
+	next = lfu_bucket_after(st, prev, n->freq);
+	lfu_unlink(st, n);
+	n->policy_data = next;
+	list_add_tail(&n->list, &next->nodes);
+}
+
+static void
+lfu_touch(void *st_v, node *n)
+{
+	lfu_add(st_v, n, 1);
+}
+
+static node *
+lfu_victim(void *st_v)
+{
+	struct lfu *st = st_v;
+	unsigned long pending;
+	node *n, *first = NULL;
+
+	while (!list_empty(&st->buckets)) {
+		/* buckets are never empty */
+		n = oldest(&list_first_entry(&st->buckets, struct lfu_bucket,
+					     list)->nodes);
+		if (n == first || !(pending = policy_pending(n)))
+			return n;
+		if (!first)
+			first = n;
+		lfu_add(st, n, pending);
+	}
+	return NULL;
+}
+
+static void
+lfu_remove(void *st_v, node *n)
+{
+	lfu_unlink(st_v, n);
+}
+
+static const struct cache_policy lfu_policy = {
+	"lfu", lfu_init, lfu_insert, lfu_touch, lru_miss, lfu_victim,
+	lfu_remove,
+};
+
+/*
+ * ARC: adaptive replacement cache (Megiddo and Modha), counting bytes. T1
+ * holds files seen once recently and T2 files seen at least twice. B1 and B2
+ * remember the name hashes of files recently evicted from T1 and T2. A miss
+ * that hits in B1 grows p, the target size of T1, and a miss that hits in B2
+ * shrinks it.
+ */
+
+enum { ARC_T1, ARC_T2, ARC_B1, ARC_B2 };
+
+struct arc_ghost {
+	unsigned long hash;
+	unsigned size;
+	int where;		/* ARC_B1 or ARC_B2 */
+	struct list_head list;	/* position in B1 or B2 */
+	struct hlist_node chain;
+};
+
+struct arc {
+	struct list_head t1, t2, b1, b2;	/* least recently used first */
+	unsigned t1_size, t2_size, b1_size, b2_size;
+	unsigned p;
+	unsigned c;
+	struct hlist_head *ghosts;	/* ghost entries by name hash */
+	unsigned nr_ghost_buckets;
+};
+
+static void *
+arc_init(unsigned max_size)
+{
+	struct arc *st = Malloc(sizeof(struct arc));
+
+	INIT_LIST_HEAD(&st->t1);
+	INIT_LIST_HEAD(&st->t2);
+	INIT_LIST_HEAD(&st->b1);
+	INIT_LIST_HEAD(&st->b2);
+	st->t1_size = st->t2_size = st->b1_size = st->b2_size = 0;
+	st->p = 0;
+	st->c = max_size;
+	/* about one bucket per 4KB the ghost lists can describe */
+	st->nr_ghost_buckets = 64;
+	while (st->nr_ghost_buckets < max_size / 2048)
+		st->nr_ghost_buckets *= 2;
+	st->ghosts = calloc(st->nr_ghost_buckets, sizeof(struct hlist_head));
+	assert(st->ghosts);
+	return st;
+}
+
+static struct arc_ghost *
+arc_ghost_find(struct arc *st, unsigned long hash)
+{
+	struct arc_ghost *g;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(g, pos,
+			     &st->ghosts[hash & (st->nr_ghost_buckets - 1)],
+			     chain) {
+		if (g->hash == hash)
+			return g;
+	}
+	return NULL;
+}
+
+static void
+arc_ghost_del(struct arc *st, struct arc_ghost *g)
+{
+	if (g->where == ARC_B1)
+		st->b1_size -= g->size;
+	else
+		st->b2_size -= g->size;
+	list_del(&g->list);
+	hlist_del(&g->chain);
+	free(g);
+}
+
+/* remember that n was evicted, then trim the ghost lists so that T1 + B1 and
+ * the whole directory stay within c and 2c bytes */
+static void
+arc_ghost_add(struct arc *st, node *n)
+{
+	struct arc_ghost *g = arc_ghost_find(st, n->hash);
+
+	if (g)
+		arc_ghost_del(st, g);
+	g = Malloc(sizeof(struct arc_ghost));
+	g->hash = n->hash;
+	g->size = NODE_SIZE(n);
+	if (n->where == ARC_T1) {
+		g->where = ARC_B1;
+		list_add_tail(&g->list, &st->b1);
+		st->b1_size += g->size;
+	} else {
+		g->where = ARC_B2;
+		list_add_tail(&g->list, &st->b2);
+		st->b2_size += g->size;
+	}
+	hlist_add_head(&g->chain,
+		       &st->ghosts[g->hash & (st->nr_ghost_buckets - 1)]);
+
+	while (st->t1_size + st->b1_size > st->c && !list_empty(&st->b1))
+		arc_ghost_del(st, list_first_entry(&st->b1, struct arc_ghost,
+						   list));
+	while (st->t1_size + st->t2_size + st->b1_size + st->b2_size >
+	       2 * st->c && !list_empty(&st->b2))
+		arc_ghost_del(st, list_first_entry(&st->b2, struct arc_ghost,
+						   list));
+}
+
+static void
+arc_insert(void *st_v, node *n)
+{
+	struct arc *st = st_v;
+	struct arc_ghost *g = arc_ghost_find(st, n->hash);
+	unsigned size = NODE_SIZE(n);
+	unsigned delta = size;
+
+	if (g && g->where == ARC_B1) {
+		/* T1 was too small */
+		if (st->b1_size && st->b2_size > st->b1_size)
+			delta = (unsigned)((double)st->b2_size / st->b1_size *
+					   size);
+		st->p = (st->p + delta > st->c) ? st->c : st->p + delta;
+	} else if (g) {
+		/* T2 was too small */
+		if (st->b2_size && st->b1_size > st->b2_size)
+			delta = (unsigned)((double)st->b1_size / st->b2_size *
+					   size);
+		st->p = (st->p > delta) ? st->p - delta : 0;
+	}
+
+	if (g) {
+		arc_ghost_del(st, g);
+		n->where = ARC_T2;
+		list_add_tail(&n->list, &st->t2);
+		st->t2_size += size;
+	} else {
+		n->where = ARC_T1;
+		list_add_tail(&n->list, &st->t1);
+		st->t1_size += size;
+	}
+}
+
+static void
+arc_touch(void *st_v, node *n)
+{
+	struct arc *st = st_v;
+
+	list_del(&n->list);
+	if (n->where == ARC_T1) {
+		st->t1_size -= NODE_SIZE(n);
+		st->t2_size += NODE_SIZE(n);
+		n->where = ARC_T2;
+	}
+	list_add_tail(&n->list, &st->t2);
+}
+
+/* the node that the target size p says to evict next */
+static node *
+arc_next(struct arc *st)
+{
+	node *n = NULL;
+
+	if (st->t1_size > st->p)
+		n = oldest(&st->t1);
+	if (!n)
+		n = oldest(&st->t2);
+	if (!n)
+		n = oldest(&st->t1);
+	return n;
+}
+
+static node *
+arc_victim(void *st_v)
+{
+	struct arc *st = st_v;
+	node *n, *first = NULL;
+
+	while ((n = arc_next(st)) && n != first && policy_pending(n)) {
+		if (!first)
+			first = n;
+		arc_touch(st, n);
+	}
+	if (n)
+		arc_ghost_add(st, n);
+	return n;
+}
+
+static void
+arc_remove(void *st_v, node *n)
+{
+	struct arc *st = st_v;
+
+	list_del(&n->list);
+	if (n->where == ARC_T1)
+		st->t1_size -= NODE_SIZE(n);
+	else
+		st->t2_size -= NODE_SIZE(n);
+}
+
+static const struct cache_policy arc_policy = {
+	"arc", arc_init, arc_insert, arc_touch, lru_miss, arc_victim,
+	arc_remove,
+};
+
+/*
+ * W-TinyLFU (Einziger, Friedman and Manes). New files enter a small LRU
+ * window (1% of the bytes). Files pushed out of the window move to the
+ * probation part of a segmented LRU, and a hit in probation promotes a file to
+ * the protected part (80% of the main bytes). A file that just left the window
+ * is a candidate: when something has to be evicted, the candidate only stays
+ * if the frequency sketch says it is more popular than the main victim. This
+ * keeps one-off files from flushing popular ones.
+ */
+
+enum { TLFU_WINDOW, TLFU_PROBATION, TLFU_PROTECTED };
+
+struct tinylfu {
+	struct list_head window, probation, protected;	/* LRU first */
+	unsigned window_size, protected_size;
+	unsigned window_max, protected_max;
+	node *candidate;	/* last node moved from window to probation */
+	struct sketch *sketch;
+};
+
+static void *
+tinylfu_init(unsigned max_size)
+{
+	struct tinylfu *st = Malloc(sizeof(struct tinylfu));
+
+	INIT_LIST_HEAD(&st->window);
+	INIT_LIST_HEAD(&st->probation);
+	INIT_LIST_HEAD(&st->protected);
+	st->window_size = st->protected_size = 0;
+	st->window_max = max_size / 100;
+	st->protected_max = (max_size - st->window_max) / 10 * 8;
+	st->candidate = NULL;
+	/* files are 4KB or larger, so the cache holds at most this many */
+	st->sketch = sketch_init(max_size / 4096);
+	return st;
+}
+
+static void
+tinylfu_move(struct tinylfu *st, node *n, int where)
+{
+	if (n->where == TLFU_WINDOW)
+		st->window_size -= NODE_SIZE(n);
+	else if (n->where == TLFU_PROTECTED)
+		st->protected_size -= NODE_SIZE(n);
+	list_del(&n->list);
+
+	n->where = where;
+	if (where == TLFU_WINDOW) {
+		st->window_size += NODE_SIZE(n);
+		list_add_tail(&n->list, &st->window);
+	} else if (where == TLFU_PROTECTED) {
+		st->protected_size += NODE_SIZE(n);
+		list_add_tail(&n->list, &st->protected);
+	} else {
+		list_add_tail(&n->list, &st->probation);
+	}
+}
+
+static void
+tinylfu_insert(void *st_v, node *n)
+{
+	struct tinylfu *st = st_v;
+
+	n->where = TLFU_WINDOW;
+	list_add_tail(&n->list, &st->window);
+	st->window_size += NODE_SIZE(n);
+
+	/* the window overflows into probation */
+	while (st->window_size > st->window_max) {
+		node *w = list_first_entry(&st->window, node, list);
+		if (w == n)
+			break;
+		tinylfu_move(st, w, TLFU_PROBATION);
+		st->candidate = w;
+	}
+}
+
+static void
+tinylfu_touch(void *st_v, node *n)
+{
+	struct tinylfu *st = st_v;
+
+	sketch_increment(st->sketch, n->hash);
+	if (n == st->candidate)
+		st->candidate = NULL;
+
+	if (n->where == TLFU_WINDOW) {
+		tinylfu_move(st, n, TLFU_WINDOW);
+		return;
+	}
+	tinylfu_move(st, n, TLFU_PROTECTED);
+	/* protected overflows back into probation */
+	while (st->protected_size > st->protected_max) {
+		node *p = list_first_entry(&st->protected, node, list);
+		if (p == n)
+			break;
+		tinylfu_move(st, p, TLFU_PROBATION);
+	}
+}
+
+static void
+tinylfu_miss(void *st_v, unsigned long hash)
+{
+	struct tinylfu *st = st_v;
+	sketch_increment(st->sketch, hash);
+}
+
+/* takes in the hits made on n without the lock, if any: the sketch counts
+ * them, as many as it can hold, and n is touched once. returns whether there
+ * were any */
+static int
+tinylfu_pending(struct tinylfu *st, node *n)
+{
+	unsigned long pending = policy_pending(n);
+
+	if (!pending)
+		return 0;
+	if (pending > SKETCH_MAX)
+		pending = SKETCH_MAX;
+	while (--pending)
+		sketch_increment(st->sketch, n->hash);
+	tinylfu_touch(st, n);
+	return 1;
+}
+
+/* the oldest node of the main part, probation first */
+static node *
+tinylfu_oldest_main(struct tinylfu *st)
+{
+	node *n = oldest(&st->probation);
+
+	return n ? n : oldest(&st->protected);
+}
+
+static node *
+tinylfu_victim(void *st_v)
+{
+	struct tinylfu *st = st_v;
+	node *victim, *candidate, *first = NULL;
+
+	/* a candidate with hits is promoted, and is not one anymore */
+	if (st->candidate)
+		tinylfu_pending(st, st->candidate);
+	while ((victim = tinylfu_oldest_main(st)) && victim != first &&
+	       tinylfu_pending(st, victim)) {
+		if (!first)
+			first = victim;
+	}
+	candidate = st->candidate;
+	if (candidate && victim && victim != candidate) {
+		st->candidate = NULL;
+		if (sketch_estimate(st->sketch, candidate->hash) <=
+		    sketch_estimate(st->sketch, victim->hash))
+			return candidate;
+	}
+	if (!victim)
+		victim = oldest(&st->window);
+	return victim;
+}
+
+static void
+tinylfu_remove(void *st_v, node *n)
+{
+	struct tinylfu *st = st_v;
+
+	if (n == st->candidate)
+		st->candidate = NULL;
+	if (n->where == TLFU_WINDOW)
+		st->window_size -= NODE_SIZE(n);
+	else if (n->where == TLFU_PROTECTED)
+		st->protected_size -= NODE_SIZE(n);
+	list_del(&n->list);
+}
+
+static const struct cache_policy tinylfu_policy = {
+	"tinylfu", tinylfu_init, tinylfu_insert, tinylfu_touch, tinylfu_miss,
+	tinylfu_victim, tinylfu_remove,
+};
+
+/* policy lookup */
+
+const struct cache_policy *cache_policies[] = {
+	&lru_policy, &clock_policy, &lfu_policy, &arc_policy, &tinylfu_policy,
+	NULL,
+};
+
+const struct cache_policy *
+cache_policy_find(const char *name)
+{
+	int i;
+
+	for (i = 0; cache_policies[i]; i++) {
+		if (!strcmp(cache_policies[i]->name, name))
+			return cache_policies[i];
+	}
+	return NULL;
+}
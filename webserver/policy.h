@@ -0,0 +1,33 @@
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+struct node_;
+
+/* an eviction policy decides which cached file to evict next. each cache shard
+ * has its own policy state, created by init, and all the functions below are
+ * called with the shard lock held.
+ *
+ * insert:  n was just added to the cache
+ * touch:   n was requested and found in the cache
+ * miss:    a file with this name hash was requested but not cached
+ * victim:  returns the node to evict next, or NULL if the shard is empty.
+ *          hits made without the lock are only counted in the nodes, see
+ *          cache_touch_nolock(), and victim takes them in for the nodes it
+ *          looks at before it picks one
+ * remove:  n is about to be removed from the cache */
+struct cache_policy {
+	const char *name;
+	void *(*init)(unsigned max_size);
+	void  (*insert)(void *st, struct node_ *n);
+	void  (*touch)(void *st, struct node_ *n);
+	void  (*miss)(void *st, unsigned long hash);
+	struct node_ *(*victim)(void *st);
+	void  (*remove)(void *st, struct node_ *n);
+};
+
+/* NULL terminated list of all policies, the first one is the default */
+extern const struct cache_policy *cache_policies[];
+
+const struct cache_policy *cache_policy_find(const char *name);
+
+#endif /* __POLICY_H__ */
@@ -0,0 +1,171 @@
+#include "common.h"
+#include "queue.h"
+#include "parking.h"
+
+#define CACHE_LINE 64
+/* times a thread retries a full or empty queue before it parks, if there is
+ * another cpu that could be changing it meanwhile */
+#define QUEUE_SPINS 64
+
+/* the slot for position pos is free when its seq is 2 * pos, and full when it
+ * is 2 * pos + 1. popping it frees it for position pos + size. the usual seq
+ * = pos, pos + 1 does not tell a full slot from a free one in a queue of
+ * size 1. */
+struct slot {
+	unsigned long seq;
+	int v;
+};
+
+struct queue {
+	unsigned size;
+	int spins;
+	struct slot *slots;
+	/* producers and consumers do not share cache lines */
+	unsigned long tail __attribute__((aligned(CACHE_LINE)));
+	unsigned long head __attribute__((aligned(CACHE_LINE)));
+	struct parking not_full;	/* producers wait here */
+	struct parking not_empty;	/* consumers wait here */
+};
+
+struct queue *
+queue_init(unsigned size)
+{
+	struct queue *q;
+	unsigned i;
+
+	assert(size > 0);
+	/* sizeof is a multiple of the alignment */
+	q = aligned_alloc(CACHE_LINE, sizeof(struct queue));
+	if (!q) {
+		unix_error("aligned_alloc");
+	}
+	memset(q, 0, sizeof(struct queue));
+	parking_init(&q->not_full);
+	parking_init(&q->not_empty);
+	q->size = size;
+	q->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? QUEUE_SPINS : 0;
+	q->slots = Malloc(sizeof(struct slot) * size);
+	for (i = 0; i < size; i++) {
+		q->slots[i].seq = 2 * i;
+	}
+	return q;
+}
+
+void
+queue_destroy(struct queue *q)
+{
+	free(q->slots);
+	free(q);
+}
+
+/* returns 0 if the queue is full */
+int
+queue_try_push(struct queue *q, int v)
+{
+	unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	struct slot *s;
+	long dif;
+
+	while (1) {
+		s = &q->slots[pos % q->size];
+		dif = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - 2 * pos;
+		if (dif == 0) {
+			/* free, claim it. on failure, pos is reloaded */
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1,
+							1, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			/* still full from the last time around */
+			return 0;
+		} else {
+			/* another producer got there first */
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+	s->v = v;
+	__atomic_store_n(&s->seq, 2 * pos + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* returns 0 if the queue is empty */
+int
+queue_try_pop(struct queue *q, int *v)
+{
+	unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	struct slot *s;
+	long dif;
+
+	while (1) {
+		s = &q->slots[pos % q->size];
+		dif = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - (2 * pos + 1);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1,
+							1, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			/* not pushed yet */
+			return 0;
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+	*v = s->v;
+	__atomic_store_n(&s->seq, 2 * (pos + q->size), __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* how many entries the queue holds, which may have changed by the time the
+ * caller looks */
+unsigned
+queue_depth(struct queue *q)
+{
+	unsigned long head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	unsigned long tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+	return tail > head ? tail - head : 0;
+}
+
+void
+queue_push(struct queue *q, int v)
+{
+	struct parking *p = &q->not_full;
+	unsigned int seq;
+	int i, done;
+
+	for (i = 0; !queue_try_push(q, v); i++) {
+		if (i < q->spins)
+			continue;
+		seq = parking_prepare(p);
+		done = queue_try_push(q, v);
+		if (!done)
+			parking_wait(p, seq);
+		parking_done(p);
+		if (done)
+			break;
+	}
+	parking_wake(&q->not_empty);
+}
+
+int
+queue_pop(struct queue *q)
+{
+	struct parking *p = &q->not_empty;
+	unsigned int seq;
+	int i, done, v;
+
+	for (i = 0; !queue_try_pop(q, &v); i++) {
+		if (i < q->spins)
+			continue;
+		seq = parking_prepare(p);
+		done = queue_try_pop(q, &v);
+		if (!done)
+			parking_wait(p, seq);
+		parking_done(p);
+		if (done)
+			break;
+	}
+	parking_wake(&q->not_full);
+	return v;
+}
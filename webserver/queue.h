@@ -0,0 +1,24 @@
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+/* a bounded multi-producer multi-consumer queue of ints, e.g. connection
+ * descriptors, after Vyukov's bounded MPMC queue. queue_push and queue_pop
+ * take no lock: producers and consumers claim positions with a compare and
+ * swap, and each slot carries a sequence number that says whether it is
+ * free or full for a given position.
+ *
+ * a thread that finds the queue full (queue_push) or empty (queue_pop)
+ * spins briefly, then parks on a futex. the other side only makes the
+ * system call that wakes it if a thread is actually parked. */
+struct queue;
+
+struct queue *queue_init(unsigned size);
+void queue_push(struct queue *q, int v);
+int queue_pop(struct queue *q);
+/* like queue_push and queue_pop, but return 0 instead of waiting */
+int queue_try_push(struct queue *q, int v);
+int queue_try_pop(struct queue *q, int *v);
+unsigned queue_depth(struct queue *q);
+void queue_destroy(struct queue *q);
+
+#endif /* __QUEUE_H__ */
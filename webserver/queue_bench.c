@@ -0,0 +1,199 @@
+/*
+ * queue_bench.c: measures the cost of handing items from producer threads to
+ * consumer threads through the request queue.
+ *
+ * To run:
+ *  queue_bench [-p nr_producers] [-c nr_consumers] [-s size] [nr_items]
+ *
+ * Each of nr_producers threads (1 by default) pushes nr_items items into a
+ * queue of size slots (16 by default) that nr_consumers threads (4 by
+ * default) pop, like the main thread hands connections to the worker threads
+ * in the threads mode. Times the lock-free queue of queue.h, and a queue
+ * protected by a mutex with two condition variables, which is how the
+ * threads mode used to do it. Also checks that every item is popped once.
+ */
+
+#include "common.h"
+#include "queue.h"
+
+#define DEFAULT_NR_ITEMS 1000000
+#define DEFAULT_SIZE 16
+#define MAX_THREADS 256
+
+/* the locked queue */
+struct locked_queue {
+	int *q;
+	unsigned size, start, count;
+	pthread_mutex_t lock;
+	pthread_cond_t not_full;
+	pthread_cond_t not_empty;
+};
+
+static struct locked_queue *
+locked_init(unsigned size)
+{
+	struct locked_queue *q = Malloc(sizeof(struct locked_queue));
+
+	q->q = Malloc(sizeof(int) * size);
+	q->size = size;
+	q->start = q->count = 0;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	return q;
+}
+
+static void
+locked_push(struct locked_queue *q, int v)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->size) {
+		pthread_cond_wait(&q->not_full, &q->lock);
+	}
+	q->q[(q->start + q->count++) % q->size] = v;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static int
+locked_pop(struct locked_queue *q)
+{
+	int v;
+
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0) {
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	}
+	v = q->q[q->start];
+	q->start = (q->start + 1) % q->size;
+	q->count--;
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+	return v;
+}
+
+static int nr_items = DEFAULT_NR_ITEMS;
+static int locked;		/* which queue is being timed */
+static struct queue *lf_q;
+static struct locked_queue *locked_q;
+static long popped_sum;		/* of all the items popped */
+
+static void
+push(int v)
+{
+	if (locked)
+		locked_push(locked_q, v);
+	else
+		queue_push(lf_q, v);
+}
+
+static int
+pop(void)
+{
+	return locked ? locked_pop(locked_q) : queue_pop(lf_q);
+}
+
+static void *
+producer(void *arg)
+{
+	int i;
+
+	for (i = 0; i < nr_items; i++) {
+		push(i);
+	}
+	return NULL;
+}
+
+/* pops until it gets a -1 */
+static void *
+consumer(void *arg)
+{
+	long sum = 0;
+	int v;
+
+	while ((v = pop()) >= 0) {
+		sum += v;
+	}
+	__atomic_add_fetch(&popped_sum, sum, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	pthread_t producers[MAX_THREADS], consumers[MAX_THREADS];
+	int nr_producers = 1, nr_consumers = 4, size = DEFAULT_SIZE;
+	int usage = 0;
+	int i, c;
+
+	while ((c = getopt(argc, argv, "p:c:s:")) != -1) {
+		switch (c) {
+		case 'p':
+			nr_producers = atoi(optarg);
+			break;
+		case 'c':
+			nr_consumers = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		default:
+			usage = 1;
+		}
+	}
+	if (usage || nr_producers < 1 || nr_producers > MAX_THREADS ||
+	    nr_consumers < 1 || nr_consumers > MAX_THREADS || size < 1 ||
+	    argc > optind + 1) {
+		fprintf(stderr, "Usage: %s [-p nr_producers] [-c nr_consumers] "
+			"[-s size] [nr_items]\n", argv[0]);
+		exit(1);
+	}
+	if (argc == optind + 1) {
+		nr_items = atoi(argv[optind]);
+		assert(nr_items > 0);
+	}
+
+	printf("producers = %d, consumers = %d, size = %d\n", nr_producers,
+	       nr_consumers, size);
+	printf("%8s %12s %12s\n", "queue", "ns/item", "Mitems/s");
+	for (locked = 0; locked < 2; locked++) {
+		struct timeval start, end, diff;
+		double ns;
+
+		lf_q = queue_init(size);
+		locked_q = locked_init(size);
+		popped_sum = 0;
+
+		gettimeofday(&start, NULL);
+		for (i = 0; i < nr_consumers; i++) {
+			SYS(pthread_create(&consumers[i], NULL, consumer, NULL));
+		}
+		for (i = 0; i < nr_producers; i++) {
+			SYS(pthread_create(&producers[i], NULL, producer, NULL));
+		}
+		for (i = 0; i < nr_producers; i++) {
+			pthread_join(producers[i], NULL);
+		}
+		for (i = 0; i < nr_consumers; i++) {
+			push(-1);
+		}
+		for (i = 0; i < nr_consumers; i++) {
+			pthread_join(consumers[i], NULL);
+		}
+		gettimeofday(&end, NULL);
+		timersub(&end, &start, &diff);
+		assert(popped_sum ==
+		       (long)nr_producers * nr_items * (nr_items - 1) / 2);
+
+		/* wall clock time per item pushed */
+		ns = (diff.tv_sec * 1e9 + diff.tv_usec * 1e3) /
+			((double)nr_producers * nr_items);
+		printf("%8s %12.1f %12.2f\n", locked ? "locked" : "lockfree",
+		       ns, 1e3 / ns);
+
+		queue_destroy(lf_q);
+		free(locked_q->q);
+		free(locked_q);
+	}
+	exit(0);
+}
@@ -2,72 +2,251 @@
  * request.c: Does the bulk of the work for the web server.
  */
 
+/* for strptime and timegm */
+#define _GNU_SOURCE
+#include <time.h>
+#include <zlib.h>
 #include "common.h"
 #include "request.h"
+#include "csum.h"
+#include "http.h"
+#include "arena.h"
+#include "cache.h"
+
+/* at most this many ranges are served from one request, a Range header with
+ * more is ignored */
+#define RANGES_MAX 8
+/* separates the ranges of a multipart/byteranges response */
+#define RANGE_BOUNDARY "OS_Web_Server_byteranges_7d3f9a2c"
+
+/* a range of bytes the client asks for, from first to last included. last is
+ * -1 if the range runs to the end of the file, and first is -1 if it is the
+ * last bytes of the file, as many as last says */
+struct range {
+	long first, last;
+};
 
 struct request {
 	int fd;		 /* descriptor for client connection */
+	int file_fd;	 /* the opened file, see request_openfile */
 	struct file_data *data;
+	int keep_alive;	 /* the connection stays open after the response */
+	int gzip;	 /* the client accepts a gzip body */
+	unsigned long gzip_mallocs;	/* Malloc calls made compressing the
+					 * file, see request_gzip_mallocs */
+	struct range ranges[RANGES_MAX];	/* asked for, if nr_ranges */
+	int nr_ranges;
+	/* the conditions of a conditional GET, see request_not_modified */
+	char *if_none_match;	/* a list of ETags, in the arena, or NULL */
+	time_t if_modified_since;	/* or -1 */
+	/* the response, staged by request_error or request_sendfile and
+	 * written by request_write */
+	struct iovec *iov;	/* iov_buf, or more of them in the arena */
+	struct iovec iov_buf[3];	/* header, Connection line and body in
+					 * memory */
+	int iov_first, iovcnt;	/* the buffers not written yet */
+	off_t file_off;		/* then the rest of file_fd */
+	size_t file_left;
+	char *err;		/* an error response */
+	struct arena *arena;	/* holds the request and err */
+};
+
+/* ends the response header, indexed by rq->keep_alive */
+static const char *request_connection[] = {
+	"Connection: close\r\n\r\n",
+	"Connection: keep-alive\r\n\r\n",
 };
 
-/* requestError(fd, filename, "404", "Not found", 
+/* like request_error, with more header lines, each ending with a CRLF */
+static void
+request_error_header(struct request *rq, char *cause, char *errnum,
+		     char *shortmsg, char *longmsg, const char *header)
+{
+	char body[MAXBUF];
+	int body_len, len;
+	unsigned int csum;
+
+	/* create the body of the error message */
+	body_len = snprintf(body, MAXBUF,
+			    "<html><title>OS Web Server Error</title>"
+			    "<body bgcolor=" "fffff" ">\r\n"
+			    "<p>%s: %s</p>\r\n"
+			    "<p>%s: %.*s</p>\r\n"
+			    "</body></html>\r\n", errnum, shortmsg, longmsg,
+			    MAXLINE, cause);
+	assert(body_len < MAXBUF);
+
+	/* generate a very trivial checksum */
+	csum = csum_buf(body, body_len);
+
+	/* put together the header information and the content */
+	rq->err = arena_alloc(rq->arena, MAXLINE + MAXBUF);
+	len = snprintf(rq->err, MAXLINE + MAXBUF,
+		       "HTTP/1.1 %s %s\r\n"
+		       "Content-Type: text/html\r\n"
+		       "Content-Length: %d\r\n"
+		       "Content-Csum: %u\r\n"
+		       "%s%s%s", errnum, shortmsg, body_len, csum, header,
+		       request_connection[rq->keep_alive], body);
+	printf("%s", rq->err);
+
+	rq->iov = rq->iov_buf;
+	rq->iov[0].iov_base = rq->err;
+	rq->iov[0].iov_len = len;
+	rq->iov_first = 0;
+	rq->iovcnt = 1;
+	rq->file_left = 0;
+}
+
+/* requestError(rq, filename, "404", "Not found", 
  *		"OS server could not find this file");
  */
 static void
-request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
+request_error(struct request *rq, char *cause, char *errnum, char *shortmsg,
+	      char *longmsg)
+{
+	request_error_header(rq, cause, errnum, shortmsg, longmsg, "");
+}
+
+/* sets rq->keep_alive from the value of a Connection header */
+static void
+request_parse_connection(struct request *rq, const char *value, int len)
 {
-	char buf[MAXLINE], body[MAXBUF];
 	int i;
-	unsigned int csum = 0;
 
-	/* create the body of the error message */
-	sprintf(body, "<html><title>OS Web Server Error</title>");
-	sprintf(body, "%s<body bgcolor=" "fffff" ">\r\n", body);
-	sprintf(body, "%s<p>%s: %s</p>\r\n", body, errnum, shortmsg);
-	sprintf(body, "%s<p>%s: %s</p>\r\n", body, longmsg, cause);
-	sprintf(body, "%s</body></html>\r\n", body);
+	for (i = 0; i < len; i++) {
+		if (len - i >= 5 && !strncasecmp(value + i, "close", 5))
+			rq->keep_alive = 0;
+		else if (len - i >= 10 &&
+			 !strncasecmp(value + i, "keep-alive", 10))
+			rq->keep_alive = 1;
+	}
+}
 
-	/* write out the header information for this response */
-	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+/* sets rq->gzip from the value of an Accept-Encoding header, a list of
+ * codings, each maybe with a q value. a q value of 0 refuses the coding */
+static void
+request_parse_accept_encoding(struct request *rq, const char *value, int len)
+{
+	const char *p = value, *end = value + len, *next, *q;
+	char qvalue[16];
+	int n;
 
-	sprintf(buf, "Content-Type: text/html\r\n");
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	while (p < end) {
+		next = memchr(p, ',', end - p);
+		if (!next)
+			next = end;
+		while (p < next && (*p == ' ' || *p == '\t'))
+			p++;
+		for (n = 0; p + n < next && p[n] != ';' && p[n] != ' ' &&
+			     p[n] != '\t'; n++)
+			;
+		if ((n == 4 && !strncasecmp(p, "gzip", 4)) ||
+		    (n == 6 && !strncasecmp(p, "x-gzip", 6)) ||
+		    (n == 1 && *p == '*')) {
+			rq->gzip = 1;
+			for (q = p + n; q + 2 < next; q++) {
+				if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=') {
+					snprintf(qvalue, sizeof(qvalue), "%.*s",
+						 (int)(next - q - 2), q + 2);
+					rq->gzip = atof(qvalue) > 0;
+					break;
+				}
+			}
+		}
+		p = next + 1;
+	}
+}
 
-	sprintf(buf, "Content-Length: %ld\r\n", strlen(body));
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+/* a copy of the len bytes of s, in the request's arena */
+static char *
+request_arena_copy(struct request *rq, const char *s, int len)
+{
+	char *copy = arena_alloc(rq->arena, len + 1);
 
-	/* generate a very trivial checksum */
-	for (i = 0; i < strlen(body); i++) {
-		csum += (unsigned char)(body[i]);
-	}
-	sprintf(buf, "Content-Csum: %u\r\n\r\n", csum);
-	Rio_write(fd, buf, strlen(buf));
-	printf("%s", buf);
+	memcpy(copy, s, len);
+	copy[len] = '\0';
+	return copy;
+}
+
+/* sets rq->if_modified_since from the value of an If-Modified-Since header,
+ * an HTTP date. a date that is not understood is ignored */
+static void
+request_parse_date(struct request *rq, const char *value, int len)
+{
+	char date[64];
+	struct tm tm;
+	char *end;
 
-	/* write out the content */
-	Rio_write(fd, body, strlen(body));
-	printf("%s", body);
+	snprintf(date, sizeof(date), "%.*s", len, value);
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (end && !*end)
+		rq->if_modified_since = timegm(&tm);
+}
+
+/* reads the digits at *p, before end, into *v and moves *p past them.
+ * returns 0, leaving *v alone, if there are none */
+static int
+request_parse_number(const char **p, const char *end, long *v)
+{
+	const char *start = *p;
+	long n = 0;
 
+	while (*p < end && **p >= '0' && **p <= '9' && n < LONG_MAX / 10 - 9) {
+		n = n * 10 + (**p - '0');
+		(*p)++;
+	}
+	if (*p == start)
+		return 0;
+	*v = n;
+	return 1;
 }
 
-/* reads and discards everything up to an empty text line */
+/* fills rq->ranges from the value of a Range header, e.g. bytes=0-99,200-,-50.
+ * a header that is not understood, or asks for too many ranges, is ignored
+ * and the whole file is sent */
 static void
-request_read_headers(struct rio *rp)
+request_parse_range(struct request *rq, const char *value, int len)
 {
-	char buf[MAXLINE];
+	const char *p = value, *end = value + len, *next;
+	struct range *r;
 
-	Rio_readlineb(rp, buf, MAXLINE);
-	while (strcmp(buf, "\r\n")) {
-		Rio_readlineb(rp, buf, MAXLINE);
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	if (end - p < 6 || strncasecmp(p, "bytes=", 6))
+		return;
+	for (p += 6; p < end; p = next + 1) {
+		next = memchr(p, ',', end - p);
+		if (!next)
+			next = end;
+		while (p < next && (*p == ' ' || *p == '\t'))
+			p++;
+		if (p == next)
+			continue;
+		if (rq->nr_ranges == RANGES_MAX)
+			goto ignore;
+		r = &rq->ranges[rq->nr_ranges++];
+		r->first = r->last = -1;
+		if (*p != '-' && !request_parse_number(&p, next, &r->first))
+			goto ignore;
+		if (p == next || *p++ != '-')
+			goto ignore;
+		if (request_parse_number(&p, next, &r->last) &&
+		    r->first >= 0 && r->last < r->first)
+			goto ignore;
+		if (r->first < 0 && r->last < 0)
+			goto ignore;
+		while (p < next && (*p == ' ' || *p == '\t'))
+			p++;
+		if (p != next)
+			goto ignore;
 	}
 	return;
+ignore:
+	rq->nr_ranges = 0;
 }
 
-
 /* Calculates filename from uri. 
  * for this simple server, filename = .uri
  *
@@ -75,77 +254,357 @@ request_read_headers(struct rio *rp)
  * which the webserver is running.
  *
  * Also, we don't serve files with a .. in the path (see request_readfile). */
-static void
-request_parse_URI(char *uri, char *filename, size_t max)
+void
+request_parse_URI(const char *uri, int len, struct file_data *data)
 {
-	snprintf(filename, max, "./%s", uri);
+	if (len + 3 <= FILE_NAME_INLINE) {
+		data->file_name = data->file_name_buf;
+	} else {
+		data->file_name = Malloc(len + 3);
+	}
+	snprintf(data->file_name, len + 3, "./%.*s", len, uri);
 }
 
-/* Fills in the filetype given the filename */
-static void
-request_get_file_type(char *filename, char *filetype)
+/* Returns the filetype given the filename */
+static const char *
+request_get_file_type(char *filename)
 {
 	if (strstr(filename, ".html"))
-		strcpy(filetype, "text/html");
+		return "text/html";
 	else if (strstr(filename, ".gif"))
-		strcpy(filetype, "image/gif");
+		return "image/gif";
 	else if (strstr(filename, ".jpg"))
-		strcpy(filetype, "image/jpeg");
+		return "image/jpeg";
 	else
-		strcpy(filetype, "text/plain");
+		return "text/plain";
+}
+
+/* formats t as an HTTP date, e.g. Sun, 06 Nov 1994 08:49:37 GMT */
+static void
+request_http_date(time_t t, char *buf, int len)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* the ETag of the gzip variant of data is that of the file, with -gz added
+ * inside the quotes */
+static void
+request_gzip_etag(const struct file_data *data, char *buf, int len)
+{
+	snprintf(buf, len, "%.*s-gz\"", (int)strlen(data->etag) - 1,
+		 data->etag);
+}
+
+/* computes the ETag and the content type of the file, whose checksum is in
+ * data->file_csum, and puts the response header together in data->header.
+ * the Connection line that ends the header depends on the request, and is
+ * sent after it */
+static void
+request_format_header(struct file_data *data)
+{
+	char buf[MAXBUF], date[64];
+
+	data->file_type = request_get_file_type(data->file_name);
+	/* changes whenever the contents do, unless the size and checksum
+	 * both stay the same */
+	snprintf(data->etag, sizeof(data->etag), "\"%x-%x\"",
+		 data->file_size, data->file_csum);
+	request_http_date(data->file_mtime, date, sizeof(date));
+
+	data->header_len = snprintf(buf, MAXBUF,
+				    "HTTP/1.1 200 OK\r\n"
+				    "Server: OS Web Server\r\n"
+				    "Content-Type: %s\r\n"
+				    "Content-Length: %d\r\n"
+				    "Content-Csum: %u\r\n"
+				    "ETag: %s\r\n"
+				    "Last-Modified: %s\r\n"
+				    "Vary: Accept-Encoding\r\n",
+				    data->file_type, data->file_size,
+				    data->file_csum, data->etag, date);
+	assert(data->header_len < MAXBUF);
+	data->header = Malloc(data->header_len + 1);
+	memcpy(data->header, buf, data->header_len + 1);
+}
+
+/* computes the checksum of the file, whose contents are in file_buf, and
+ * puts the response header together, see request_format_header */
+void
+request_make_header(struct file_data *data, const char *file_buf)
+{
+	/* generate a very trivial checksum */
+	data->file_csum = csum_buf(file_buf, data->file_size);
+	request_format_header(data);
+}
+
+struct request_csum {
+	const char *buf;
+	long len;
+	unsigned int csum;
+};
+
+static void
+request_csum_mapped(void *c_v)
+{
+	struct request_csum *c = (struct request_csum *)c_v;
+
+	c->csum = csum_buf(c->buf, c->len);
+}
+
+/* adds the checksum of len bytes at buf, which are data->file_buf or other
+ * memory, to *csum. returns 0 if data is mapped and was truncated on disk
+ * under us */
+static int
+request_csum(const struct file_data *data, const char *buf, long len,
+	     unsigned int *csum)
+{
+	struct request_csum c = { buf, len, 0 };
+
+	if (!data->mapped) {
+		*csum += csum_buf(buf, len);
+		return 1;
+	}
+	if (map_guard(request_csum_mapped, &c) < 0)
+		return 0;
+	*csum += c.csum;
+	return 1;
+}
+
+/* fails rq, whose file was truncated on disk while it was being read. a
+ * cached copy is checked against the disk by the next hit, which drops it */
+static void
+request_truncated(struct request *rq)
+{
+	__atomic_store_n(&rq->data->checked, 0, __ATOMIC_RELAXED);
+	request_error(rq, rq->data->file_name, "500", "Internal Server Error",
+		      "OS Web Server could not read this file");
+}
+
+/* compresses all of the input of zs at once */
+static void
+request_deflate(void *zs_v)
+{
+	if (deflate((z_stream *)zs_v, Z_FINISH) != Z_STREAM_END) {
+		unix_error("deflate error");
+	}
+}
+
+/* returns the gzip variant of data, whose contents are in memory and whose
+ * header has been made, compressing them on the first call. data may be
+ * shared by many requests at once: the first one to finish compressing
+ * publishes its variant, and the others throw theirs away. returns NULL if
+ * data is not cached, the variant is only kept along with the cached file.
+ * the Content-Csum is that of the file, the client checks it once it has
+ * decompressed the body */
+static struct file_variant *
+request_gzip(struct file_data *data)
+{
+	struct file_variant *v, *old;
+	char buf[MAXBUF], etag[40], date[64];
+	z_stream zs;
+
+	v = __atomic_load_n(&data->gzip, __ATOMIC_ACQUIRE);
+	if (v)
+		return v;
+
+	v = Malloc(sizeof(struct file_variant));
+	memset(&zs, 0, sizeof(zs));
+	/* 16 more window bits ask for a gzip header and trailer */
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK) {
+		unix_error("deflateInit2 error");
+	}
+	v->buf = Malloc(deflateBound(&zs, data->file_size));
+	zs.next_in = (Bytef *)data->file_buf;
+	zs.avail_in = data->file_size;
+	zs.next_out = (Bytef *)v->buf;
+	zs.avail_out = deflateBound(&zs, data->file_size);
+	if (!data->mapped) {
+		request_deflate(&zs);
+	} else if (map_guard(request_deflate, &zs) < 0) {
+		/* truncated on disk, the file is sent as it is and writing it
+		 * fails as well. the next hit drops it */
+		__atomic_store_n(&data->checked, 0, __ATOMIC_RELAXED);
+		deflateEnd(&zs);
+		free(v->buf);
+		free(v);
+		return NULL;
+	}
+	v->size = zs.total_out;
+	deflateEnd(&zs);
+
+	v->header = NULL;
+	v->header_len = 0;
+	if (v->size >= data->file_size) {
+		/* the file is sent as it is */
+		free(v->buf);
+		v->buf = NULL;
+	} else {
+		request_gzip_etag(data, etag, sizeof(etag));
+		request_http_date(data->file_mtime, date, sizeof(date));
+		v->header_len = snprintf(buf, MAXBUF,
+					 "HTTP/1.1 200 OK\r\n"
+					 "Server: OS Web Server\r\n"
+					 "Content-Type: %s\r\n"
+					 "Content-Encoding: gzip\r\n"
+					 "Content-Length: %d\r\n"
+					 "Content-Csum: %u\r\n"
+					 "ETag: %s\r\n"
+					 "Last-Modified: %s\r\n"
+					 "Vary: Accept-Encoding\r\n",
+					 data->file_type, v->size,
+					 data->file_csum, etag, date);
+		assert(v->header_len < MAXBUF);
+		v->header = Malloc(v->header_len + 1);
+		memcpy(v->header, buf, v->header_len + 1);
+	}
+
+	old = cache_gzip(data, v);
+	if (old != v) {
+		free(v->buf);
+		free(v->header);
+		free(v);
+	}
+	return old;
 }
 
 /* entry point to this file */
-/* returns a request struct, filling rq->fd with connfd and rq->file_name
- * with the file that is being requested. returns NULL on failure. */
+/* returns a request struct for connfd, whose file data is data, allocated in
+ * arena. the request has not been read yet, see request_parse */
 struct request *
-request_init(int connfd, struct file_data *data)
+request_create(int connfd, struct file_data *data, struct arena *arena)
 {
-	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-	struct rio *rio;
 	struct request *rq;
 
 	assert(data);
-	rq = Malloc(sizeof(struct request));
+	rq = arena_alloc(arena, sizeof(struct request));
+	rq->arena = arena;
 	rq->fd = connfd;
+	rq->file_fd = -1;
 	rq->data = data;
-	data->file_name = Malloc(MAXLINE);
+	rq->keep_alive = 0;
+	rq->gzip = 0;
+	rq->gzip_mallocs = 0;
+	rq->nr_ranges = 0;
+	rq->if_none_match = NULL;
+	rq->if_modified_since = -1;
+	rq->iov = rq->iov_buf;
+	rq->iov_first = 0;
+	rq->iovcnt = 0;
+	rq->file_off = 0;
+	rq->file_left = 0;
+	rq->err = NULL;
+	data->file_name = NULL;
 	data->file_buf = NULL;
 	data->file_size = 0;
-	rio = Rio_init(rq->fd);
-	Rio_readlineb(rio, buf, MAXLINE);
-	sscanf(buf, "%s %s %s", method, uri, version);
-
-	// printf("%s %s %s, fd = %d\n", method, uri, version, connfd);
-	if (strcasecmp(method, "GET")) {
-		request_error(rq->fd, method, "501", "Not Implemented",
-			     "OS Web Server does not implement this method");
-		Rio_destroy(rio);
-		request_destroy(rq);
-		return NULL;
-	}
-	request_read_headers(rio);
-	request_parse_URI(uri, data->file_name, MAXLINE);
-	Rio_destroy(rio);
+	data->mapped = 0;
+	data->header = NULL;
+	data->gzip = NULL;
+	data->file_mtime = 0;
+	data->checked = 0;
 	return rq;
 }
 
+/* fills data->file_name with the file that the request head in buf, parsed
+ * by p (see http.h), asks for, and decides whether the connection stays open
+ * after the response. returns 1 on success, or 0 after staging an error
+ * response */
+int
+request_parse(struct request *rq, const struct http_parser *p,
+	      const char *buf)
+{
+	const struct http_slice *connection, *encoding, *range, *cond;
+
+	/* HTTP/1.1 connections persist unless the client asks otherwise,
+	 * HTTP/1.0 ones only if it asks for it */
+	rq->keep_alive = http_slice_is(&p->version, buf, "HTTP/1.1");
+	connection = http_header(p, buf, "Connection");
+	if (connection) {
+		request_parse_connection(rq, buf + connection->off,
+					 connection->len);
+	}
+	encoding = http_header(p, buf, "Accept-Encoding");
+	if (encoding) {
+		request_parse_accept_encoding(rq, buf + encoding->off,
+					      encoding->len);
+	}
+	range = http_header(p, buf, "Range");
+	if (range) {
+		request_parse_range(rq, buf + range->off, range->len);
+	}
+	/* the head may be gone by the time the response is staged */
+	cond = http_header(p, buf, "If-None-Match");
+	if (cond) {
+		rq->if_none_match = request_arena_copy(rq, buf + cond->off,
+						       cond->len);
+	}
+	cond = http_header(p, buf, "If-Modified-Since");
+	if (cond) {
+		request_parse_date(rq, buf + cond->off, cond->len);
+	}
+
+	if (p->method.len != 3 || strncasecmp(buf + p->method.off, "GET", 3)) {
+		char method[MAXLINE];
+
+		/* the rest of the request can not be trusted */
+		rq->keep_alive = 0;
+		snprintf(method, MAXLINE, "%.*s", p->method.len,
+			 buf + p->method.off);
+		request_error(rq, method, "501", "Not Implemented",
+			      "OS Web Server does not implement this method");
+		return 0;
+	}
+	request_parse_URI(buf + p->uri.off, p->uri.len, rq->data);
+	return 1;
+}
+
+/* whether the connection stays open for another request once the response
+ * has been written */
+int
+request_keep_alive(struct request *rq)
+{
+	return rq->keep_alive;
+}
+
+/* the server may close a connection the client wanted to keep, but not the
+ * other way around. must be called before the response is staged */
+void
+request_set_keep_alive(struct request *rq, int keep_alive)
+{
+	rq->keep_alive = rq->keep_alive && keep_alive;
+}
+
+/* the Malloc calls made by request_sendfile to make the gzip variant of a
+ * file. that is done once per file, like reading it, so a cache hit that
+ * happens to do it is not charged for them */
+unsigned long
+request_gzip_mallocs(struct request *rq)
+{
+	return rq->gzip_mallocs;
+}
+
+/* closes the file the request sends, if any. the connection is left open
+ * and closed by the caller, and the memory is taken back by resetting the
+ * arena */
 void
 request_destroy(struct request *rq)
 {
 	assert(rq);
-	/* close the connection fd */
-	SYS(close(rq->fd));
-	free(rq);
+	if (rq->file_fd >= 0) {
+		SYS(close(rq->file_fd));
+	}
 }
 
-/* read in filename corresponding to request. 
- * Returns 1 on success, and fills rq->file_buf, and rq->file_size.
- * Returns 0 on failure, sends error to client. */
+/* open filename corresponding to request.
+ * Returns 1 on success, and fills data->file_size. The file is left open for
+ * request_readfile or request_sendfile, unless it is empty.
+ * Returns 0 on failure, after staging an error response. */
 int
-request_readfile(struct request *rq)
+request_openfile(struct request *rq)
 {
-	int srcfd;
 	struct stat sbuf;
 	struct file_data *data;
 	char *ext;
@@ -157,52 +616,105 @@ request_readfile(struct request *rq)
 	if (data->file_name[0] == '/') {
 		/* this shouldn't really happen because we add a "./" at the
 		 * beginning of the file path */
-		request_error(rq->fd, data->file_name, "404", "Not found",
+		request_error(rq, data->file_name, "404", "Not found",
 			      "OS Web Server doesn't serve files "
 			      "with absolute paths");
 		return 0;
 	}
 	if (strstr(data->file_name, "..") != NULL) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
+		request_error(rq, data->file_name, "404", "Not found",
 			      "OS Web Server doesn't serve files "
 			      "with .. in the path");
 		return 0;
 	}
 	if (((ext = strrchr(data->file_name, '.')) != NULL) && 
 	    ((strcmp(ext, ".c") == 0) || (strcmp(ext, ".h") == 0))) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
+		request_error(rq, data->file_name, "404", "Not found",
 			      "OS Web Server doesn't serve C or header files ");
 		return 0;
 	}
 
 	if (stat(data->file_name, &sbuf) < 0) {
-		request_error(rq->fd, data->file_name, "404", "Not found",
+		request_error(rq, data->file_name, "404", "Not found",
 			      "OS Web Server could not find this file");
 		return 0;
 	}
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-		request_error(rq->fd, data->file_name, "403", "Forbidden",
+		request_error(rq, data->file_name, "403", "Forbidden",
 			      "OS Web Server could not read this file");
 		return 0;
 	}
 
 	data->file_size = sbuf.st_size;
+	data->file_mtime = sbuf.st_mtime;
+	if (data->file_size) {
+		SYS(rq->file_fd = open(data->file_name, O_RDONLY, 0));
+	}
+	return 1;
+}
+
+/* maps the file opened by request_openfile into data->file_buf, and computes
+ * its checksum. returns 0, with nothing mapped, if the file has changed size
+ * since it was opened or is truncated while it is read */
+static int
+request_mapfile(struct request *rq)
+{
+	struct file_data *data = rq->data;
+	struct stat sbuf;
+	unsigned int csum = 0;
+
+	data->file_buf = mmap(NULL, data->file_size, PROT_READ,
+			      MAP_SHARED | MAP_POPULATE, rq->file_fd, 0);
+	if (data->file_buf == MAP_FAILED) {
+		unix_error("mmap error");
+	}
+	data->mapped = 1;
+	SYS(fstat(rq->file_fd, &sbuf));
+	if (sbuf.st_size == data->file_size &&
+	    request_csum(data, data->file_buf, data->file_size, &csum)) {
+		data->file_csum = csum;
+		return 1;
+	}
+	SYS(munmap(data->file_buf, data->file_size));
+	data->file_buf = NULL;
+	data->mapped = 0;
+	return 0;
+}
+
+/* read in the file opened by request_openfile, filling data->file_buf and the
+ * response header. if map
+ * is set, file_buf is a read-only shared mapping of the file instead of a copy
+ * on the heap. its pages are read in right away, but they stay in the page
+ * cache, and the kernel may drop them again when memory is short. a file that
+ * changes under the mapping is read into the heap instead */
+void
+request_readfile(struct request *rq, int map)
+{
+	struct file_data *data;
+
+	data = rq->data;
+	assert(data);
 
 	if (data->file_size) {
-		SYS(srcfd = open(data->file_name, O_RDONLY, 0));
-		data->file_buf = Malloc(data->file_size);
-		Rio_read(srcfd, data->file_buf, data->file_size);
-		/* ask the kernel to stop caching the file */
-		SYS(posix_fadvise(srcfd, 0, data->file_size, 
-				  POSIX_FADV_DONTNEED));
-		SYS(close(srcfd));
+		assert(rq->file_fd >= 0);
+		if (map && request_mapfile(rq)) {
+			request_format_header(data);
+		} else {
+			data->file_buf = Malloc(data->file_size);
+			Rio_read(rq->file_fd, data->file_buf, data->file_size);
+			/* ask the kernel to stop caching the file */
+			SYS(posix_fadvise(rq->file_fd, 0, data->file_size, 
+					  POSIX_FADV_DONTNEED));
+			request_make_header(data, data->file_buf);
+		}
+		SYS(close(rq->file_fd));
+		rq->file_fd = -1;
 		/* we do this to simulate a slow disk. otherwise, file caching
 		 * doesn't have much benefit because a lot of the time is spent
 		 * in processing (see request_processfile below) and so
 		 * request_readfile does not have much impact. */
 		usleep(10000);
 	}
-	return 1;
 }
 
 /* if you have previous file data, you can reuse it */
@@ -218,50 +730,440 @@ request_set_data(struct request *rq, struct file_data *data)
  * problem because we have 100 Mb/s network. With faster networks, we wouldn't
  * have to do this artificial work. */
 static void
-request_processfile(struct request *rq)
+request_processfile(const char *file_buf, int file_size)
 {
-	struct file_data *data;
 	int i, j, dummy;
-	data = rq->data;
-	assert(data);
 
 	for (i = 0; i < 128; i++) {
-		for (j = 0; j < data->file_size; j++) {
-			dummy += (unsigned char)(data->file_buf[j]);
+		for (j = 0; j < file_size; j++) {
+			dummy += (unsigned char)(file_buf[j]);
+		}
+	}
+}
+
+static void
+request_processdata(void *data_v)
+{
+	struct file_data *data = (struct file_data *)data_v;
+
+	request_processfile(data->file_buf, data->file_size);
+}
+
+/* reads len bytes at off of the file opened by request_openfile through a
+ * small buffer, rather than a mapping, which would fault if the file shrank
+ * under it. adds them to *csum if csum is not NULL, and processes them if
+ * process is set. returns 0 if the file ends before them */
+static int
+request_pread(struct request *rq, long off, long len, unsigned int *csum,
+	      int process)
+{
+	char buf[MAXBUF];
+	ssize_t n;
+
+	for (; len > 0; off += n, len -= n) {
+		n = pread(rq->file_fd, buf, len < MAXBUF ? len : MAXBUF, off);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
 		}
+		if (n <= 0)
+			return 0;
+		if (csum)
+			*csum += csum_buf(buf, n);
+		if (process)
+			request_processfile(buf, n);
 	}
+	return 1;
 }
 
-/* send filename to the fd connection */
+/* processes the file, which is in file_buf, or is read from disk if
+ * zero_copy. returns 0 if it was truncated on disk under us */
+static int
+request_process(struct request *rq, const char *file_buf, int zero_copy)
+{
+	struct file_data *data = rq->data;
+
+	if (zero_copy)
+		return request_pread(rq, 0, data->file_size, NULL, 1);
+	if (data->mapped)
+		return map_guard(request_processdata, data) == 0;
+	request_processfile(file_buf, data->file_size);
+	return 1;
+}
+
+/* whether a conditional GET finds the file unchanged, so that it need not be
+ * sent again. If-None-Match holds if one of its ETags is that of the file or
+ * of its gzip variant, compared weakly, or it is *. If-Modified-Since is only
+ * looked at without an If-None-Match */
+static int
+request_not_modified(struct request *rq)
+{
+	struct file_data *data = rq->data;
+	const char *p, *next, *end;
+	char gzip_etag[40];
+	int len;
+
+	if (!rq->if_none_match) {
+		return rq->if_modified_since >= 0 &&
+			data->file_mtime <= rq->if_modified_since;
+	}
+	request_gzip_etag(data, gzip_etag, sizeof(gzip_etag));
+	end = rq->if_none_match + strlen(rq->if_none_match);
+	for (p = rq->if_none_match; p < end; p = next + 1) {
+		next = memchr(p, ',', end - p);
+		if (!next)
+			next = end;
+		while (p < next && (*p == ' ' || *p == '\t'))
+			p++;
+		len = next - p;
+		while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t'))
+			len--;
+		if (len == 1 && *p == '*')
+			return 1;
+		if (len > 2 && !strncmp(p, "W/", 2)) {
+			p += 2;
+			len -= 2;
+		}
+		if ((len == (int)strlen(data->etag) &&
+		     !strncmp(p, data->etag, len)) ||
+		    (len == (int)strlen(gzip_etag) && !strncmp(p, gzip_etag, len)))
+			return 1;
+	}
+	return 0;
+}
+
+/* stages a 304 response, which has the validators of the file but no body.
+ * the ETag is that of the variant a 200 would have sent */
+static void
+request_stage_not_modified(struct request *rq)
+{
+	struct file_data *data = rq->data;
+	struct file_variant *v = __atomic_load_n(&data->gzip, __ATOMIC_ACQUIRE);
+	char buf[MAXBUF], etag[40], date[64];
+	int len;
+
+	if (rq->gzip && v && v->buf)
+		request_gzip_etag(data, etag, sizeof(etag));
+	else
+		snprintf(etag, sizeof(etag), "%s", data->etag);
+	request_http_date(data->file_mtime, date, sizeof(date));
+	len = snprintf(buf, MAXBUF,
+		       "HTTP/1.1 304 Not Modified\r\n"
+		       "Server: OS Web Server\r\n"
+		       "ETag: %s\r\n"
+		       "Last-Modified: %s\r\n"
+		       "Vary: Accept-Encoding\r\n", etag, date);
+	assert(len < MAXBUF);
+	rq->iov[0].iov_base = request_arena_copy(rq, buf, len);
+	rq->iov[0].iov_len = len;
+	rq->iov[1].iov_base = (char *)request_connection[rq->keep_alive];
+	rq->iov[1].iov_len = strlen(request_connection[rq->keep_alive]);
+	rq->iov_first = 0;
+	rq->iovcnt = 2;
+	rq->file_left = 0;
+}
+
+/* resolves the ranges asked for against a file of size bytes, and drops those
+ * that lie past its end. returns how many are left */
+static int
+request_resolve_ranges(struct request *rq, long size)
+{
+	struct range *r;
+	int i, n = 0;
+
+	for (i = 0; i < rq->nr_ranges; i++) {
+		r = &rq->ranges[i];
+		if (r->first < 0) {
+			/* the last r->last bytes */
+			if (r->last == 0 || size == 0)
+				continue;
+			r->first = r->last < size ? size - r->last : 0;
+			r->last = size - 1;
+		} else {
+			if (r->first >= size)
+				continue;
+			if (r->last < 0 || r->last >= size)
+				r->last = size - 1;
+		}
+		rq->ranges[n++] = *r;
+	}
+	rq->nr_ranges = n;
+	return n;
+}
+
+
+/* stages a 206 response with the resolved ranges of the file, which is in
+ * file_buf, and is sent from there or with sendfile if zero_copy. a single
+ * range is sent as it is, several go in a multipart/byteranges body, which
+ * can only be sent from memory. the Content-Csum is that of the body.
+ * returns 0, with nothing staged, if the file was truncated on disk under us */
+static int
+request_stage_ranges(struct request *rq, const char *file_buf, int zero_copy)
+{
+	struct file_data *data = rq->data;
+	struct range *r;
+	struct iovec *iov;
+	char buf[MAXBUF];
+	long body_len = 0;
+	unsigned int csum = 0;
+	int i, len, nr_iov;
+
+	if (rq->nr_ranges == 1) {
+		r = &rq->ranges[0];
+		body_len = r->last - r->first + 1;
+		if (zero_copy ?
+		    !request_pread(rq, r->first, body_len, &csum, 0) :
+		    !request_csum(data, file_buf + r->first, body_len, &csum))
+			return 0;
+		len = snprintf(buf, MAXBUF,
+			       "HTTP/1.1 206 Partial Content\r\n"
+			       "Server: OS Web Server\r\n"
+			       "Content-Type: %s\r\n"
+			       "Content-Length: %ld\r\n"
+			       "Content-Range: bytes %ld-%ld/%d\r\n"
+			       "Content-Csum: %u\r\n",
+			       data->file_type, body_len, r->first, r->last,
+			       data->file_size, csum);
+		assert(len < MAXBUF);
+		rq->iov[0].iov_base = request_arena_copy(rq, buf, len);
+		rq->iov[0].iov_len = len;
+		rq->iov[1].iov_base =
+			(char *)request_connection[rq->keep_alive];
+		rq->iov[1].iov_len = strlen(request_connection[rq->keep_alive]);
+		rq->iov_first = 0;
+		rq->iovcnt = 2;
+		if (zero_copy) {
+			rq->file_off = r->first;
+			rq->file_left = body_len;
+		} else {
+			rq->iov[2].iov_base = (char *)file_buf + r->first;
+			rq->iov[2].iov_len = body_len;
+			rq->iovcnt = 3;
+		}
+		return 1;
+	}
+
+	assert(!zero_copy);
+	/* the header, the Connection line, a part header and the part for each
+	 * range, and the closing boundary */
+	nr_iov = 2 + 2 * rq->nr_ranges + 1;
+	iov = arena_alloc(rq->arena, sizeof(struct iovec) * nr_iov);
+	for (i = 0; i < rq->nr_ranges; i++) {
+		r = &rq->ranges[i];
+		len = snprintf(buf, MAXBUF,
+			       "\r\n--" RANGE_BOUNDARY "\r\n"
+			       "Content-Type: %s\r\n"
+			       "Content-Range: bytes %ld-%ld/%d\r\n\r\n",
+			       data->file_type, r->first, r->last,
+			       data->file_size);
+		assert(len < MAXBUF);
+		iov[2 + 2 * i].iov_base = request_arena_copy(rq, buf, len);
+		iov[2 + 2 * i].iov_len = len;
+		iov[3 + 2 * i].iov_base = (char *)file_buf + r->first;
+		iov[3 + 2 * i].iov_len = r->last - r->first + 1;
+	}
+	iov[nr_iov - 1].iov_base = "\r\n--" RANGE_BOUNDARY "--\r\n";
+	iov[nr_iov - 1].iov_len = strlen(iov[nr_iov - 1].iov_base);
+	for (i = 2; i < nr_iov; i++) {
+		body_len += iov[i].iov_len;
+		if (!request_csum(data, iov[i].iov_base, iov[i].iov_len, &csum))
+			return 0;
+	}
+
+	len = snprintf(buf, MAXBUF,
+		       "HTTP/1.1 206 Partial Content\r\n"
+		       "Server: OS Web Server\r\n"
+		       "Content-Type: multipart/byteranges; "
+		       "boundary=" RANGE_BOUNDARY "\r\n"
+		       "Content-Length: %ld\r\n"
+		       "Content-Csum: %u\r\n", body_len, csum);
+	assert(len < MAXBUF);
+	iov[0].iov_base = request_arena_copy(rq, buf, len);
+	iov[0].iov_len = len;
+	iov[1].iov_base = (char *)request_connection[rq->keep_alive];
+	iov[1].iov_len = strlen(request_connection[rq->keep_alive]);
+	rq->iov = iov;
+	rq->iov_first = 0;
+	rq->iovcnt = nr_iov;
+	rq->file_left = 0;
+	return 1;
+}
+
+/* stage filename to be sent to the fd connection. a file that has been read is
+ * sent from memory with its precomputed header, or gzipped if the client
+ * accepts that and it makes the file smaller. a file that was opened but not
+ * read is sent with sendfile, so its contents never cross user space but for
+ * the checksum and the processing, which read them through a small buffer,
+ * and the header is sent with MSG_MORE so that it shares a packet with the
+ * start of the file. a client that asks for ranges of the file gets just
+ * those, see request_stage_ranges. a file sent from disk is sent whole if it
+ * asks for more than one. a conditional GET that finds the file unchanged
+ * gets a 304 without the body. a file truncated on disk while it is read
+ * gets a 500 */
 void
 request_sendfile(struct request *rq)
 {
-	char filetype[MAXLINE], buf[MAXBUF];
-	int i;
-	unsigned int csum = 0;
 	struct file_data *data;
+	struct file_variant *v = NULL;
+	const char *file_buf;
+	char buf[MAXLINE];
+	int zero_copy;
 
 	data = rq->data;
 	assert(data);
 
-	request_get_file_type(data->file_name, filetype);
-	/* generate a very trivial checksum */
-	for (i = 0; i < data->file_size; i++) {
-		csum += (unsigned char)(data->file_buf[i]);
+	file_buf = data->file_buf;
+	zero_copy = !file_buf && rq->file_fd >= 0;
+	if (zero_copy) {
+		SYS(posix_fadvise(rq->file_fd, 0, data->file_size,
+				  POSIX_FADV_SEQUENTIAL));
+		/* the disk is as slow as in request_readfile */
+		usleep(10000);
+	}
+	/* cached data got its header before it was published, see
+	 * server_fill(). only data that is private to this request, a file
+	 * sent from disk or an empty file that is not cached, gets it here */
+	if (!data->header && !data->file_buf) {
+		data->file_csum = 0;
+		if (zero_copy && !request_pread(rq, 0, data->file_size,
+						&data->file_csum, 0)) {
+			request_truncated(rq);
+			return;
+		}
+		request_format_header(data);
+	}
+	assert(data->header);
+	/* the validators are in the header, so a cached file is not looked at */
+	if (request_not_modified(rq)) {
+		request_stage_not_modified(rq);
+		return;
 	}
+
 	/* do some processing */
-	request_processfile(rq);
-	/* put together response */
-	sprintf(buf, "HTTP/1.0 200 OK\r\n");
-	sprintf(buf, "%sServer: OS Web Server\r\n", buf);
-	sprintf(buf, "%sContent-Type: %s\r\n", buf, filetype);
-	sprintf(buf, "%sContent-Length: %d\r\n", buf, data->file_size);
-	sprintf(buf, "%sContent-Csum: %u\r\n\r\n", buf, csum);
+	if (!request_process(rq, file_buf, zero_copy)) {
+		request_truncated(rq);
+		return;
+	}
 
-	Rio_write(rq->fd, buf, strlen(buf));
+	if (rq->nr_ranges &&
+	    (!request_resolve_ranges(rq, data->file_size) ||
+	     rq->nr_ranges == 1 || !zero_copy)) {
+		if (!rq->nr_ranges) {
+			snprintf(buf, MAXLINE, "Content-Range: bytes */%d\r\n",
+				 data->file_size);
+			request_error_header(rq, data->file_name, "416",
+					     "Range Not Satisfiable",
+					     "OS Web Server could not serve "
+					     "this range of the file", buf);
+		} else if (!request_stage_ranges(rq, file_buf, zero_copy)) {
+			request_truncated(rq);
+		}
+		return;
+	}
+	/* ranges apply to the file as it is */
+	if (rq->gzip && !rq->nr_ranges && !zero_copy && data->file_size > 0) {
+		unsigned long mallocs = Malloc_calls();
+
+		v = request_gzip(data);
+		rq->gzip_mallocs = Malloc_calls() - mallocs;
+		if (v && !v->buf)
+			v = NULL;
+	}
+	rq->iov[0].iov_base = v ? v->header : data->header;
+	rq->iov[0].iov_len = v ? v->header_len : data->header_len;
+	rq->iov[1].iov_base = (char *)request_connection[rq->keep_alive];
+	rq->iov[1].iov_len = strlen(request_connection[rq->keep_alive]);
+	rq->iov_first = 0;
+	rq->iovcnt = 2;
+	rq->file_off = 0;
+	rq->file_left = 0;
+	if (zero_copy) {
+		rq->file_left = data->file_size;
+	} else if (data->file_size > 0) {
+		rq->iov[2].iov_base = v ? v->buf : data->file_buf;
+		rq->iov[2].iov_len = v ? v->size : data->file_size;
+		rq->iovcnt = 3;
+	}
+}
+
+/* returns the number of staged buffers not written yet, and points iov at
+ * them */
+int
+request_iov(struct request *rq, struct iovec **iov)
+{
+	*iov = rq->iov + rq->iov_first;
+	return rq->iovcnt;
+}
+
+/* returns whether any of the staged response has not been written yet */
+int
+request_pending(struct request *rq)
+{
+	return rq->iovcnt > 0 || rq->file_left > 0;
+}
+
+/* skips the first n bytes of the staged buffers, which have been written */
+void
+request_wrote(struct request *rq, size_t n)
+{
+	struct iovec *iov = rq->iov + rq->iov_first;
 
-	/* writes data->file_buf to the client socket */
-	if (data->file_size > 0) {
-		Rio_write(rq->fd, data->file_buf, data->file_size);
+	while (rq->iovcnt > 0 && n >= iov->iov_len) {
+		n -= iov->iov_len;
+		iov++;
+		rq->iov_first++;
+		rq->iovcnt--;
+	}
+	if (rq->iovcnt > 0) {
+		iov->iov_base = (char *)iov->iov_base + n;
+		iov->iov_len -= n;
 	}
 }
+
+/* writes as much of the staged response as the socket takes: the buffers with
+ * one sendmsg, then the file with sendfile. returns 1 once all of it has been
+ * written, 0 if a non-blocking socket is full, and -1 if the client has gone
+ * away. rq->data must stay alive until then */
+int
+request_write(struct request *rq)
+{
+	struct iovec *iov;
+	ssize_t n;
+
+	while (rq->iovcnt > 0) {
+		struct msghdr msg;
+
+		iov = rq->iov + rq->iov_first;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = rq->iovcnt;
+		n = sendmsg(rq->fd, &msg, MSG_NOSIGNAL |
+			    (rq->file_left ? MSG_MORE : 0));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN ? 0 : -1;
+		}
+		request_wrote(rq, n);
+	}
+	while (rq->file_left > 0) {
+		/* sends the file from the page cache to the client socket */
+		n = sendfile(rq->fd, rq->file_fd, &rq->file_off, rq->file_left);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN ? 0 : -1;
+		}
+		if (n == 0) {
+			/* the file shrank */
+			return -1;
+		}
+		rq->file_left -= n;
+		if (rq->file_left == 0) {
+			/* ask the kernel to stop caching the file */
+			SYS(posix_fadvise(rq->file_fd, 0, rq->file_off,
+					  POSIX_FADV_DONTNEED));
+		}
+	}
+	return 1;
+}
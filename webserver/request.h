@@ -1,16 +1,82 @@
 #ifndef __REQUEST_H__
 #define __REQUEST_H__
 
+#include <stddef.h>
+#include <time.h>
+
+#define FILE_NAME_INLINE 48
+
+/* a gzip copy of a file's contents, with its own response header, sent to
+ * clients that accept it instead of the file as it is */
+struct file_variant {
+	char *buf;	/* NULL if the file does not get smaller */
+	int size;
+	char *header;
+	int header_len;
+};
+
 struct file_data {
-	char *file_name; /* name of file being requested */
+	char *file_name; /* name of file being requested, in file_name_buf
+			  * if it fits */
+	char file_name_buf[FILE_NAME_INLINE];
 	char *file_buf;	 /* file is read into this buffer in memory */
 	int file_size;	 /* file size */
+	int mapped;	 /* file_buf is a read-only mmap of the file */
+	time_t file_mtime;	 /* when the file was last modified */
+	long checked;	 /* when the file was last found unchanged on disk, in
+			  * seconds, see server_respond() */
+	/* computed once the file is read, so that sending it again takes no
+	 * work, see request_make_header() */
+	unsigned file_csum;	/* checksum of the file */
+	const char *file_type;	/* content type */
+	char *header;		/* serialized response header, up to the
+				 * Connection line that ends it */
+	int header_len;
+	char etag[32];		/* quoted, made from the size and checksum */
+	/* made from file_buf by the first request that accepts it, see
+	 * request_sendfile(). it is charged to the cache along with the file,
+	 * see cache_gzip() */
+	struct file_variant *gzip;
+	int refs;	 /* references, see file_data_get() in cache.c */
 };
 
-struct request *request_init(int connfd, struct file_data *data);
-int request_readfile(struct request *rq);
+struct iovec;
+struct http_parser;
+struct arena;
+
+/* responses are staged by request_sendfile, or by any function that fails
+ * with an error response, and written by request_write. callers that write
+ * the staged buffers themselves get them with request_iov and report what was
+ * written with request_wrote, request_write then sends the rest.
+ *
+ * the caller reads the request head and parses it with http_parse (see
+ * http.h), then calls request_create and request_parse. a persistent
+ * connection carries one request after another, each with its own struct
+ * request; request_destroy leaves the connection open. a request lives in
+ * the arena it was created in, which must not be reset until it has been
+ * destroyed. */
+struct request *request_create(int connfd, struct file_data *data,
+			       struct arena *arena);
+int request_parse(struct request *rq, const struct http_parser *p,
+		  const char *buf);
+int request_write(struct request *rq);
+int request_keep_alive(struct request *rq);
+void request_set_keep_alive(struct request *rq, int keep_alive);
+unsigned long request_gzip_mallocs(struct request *rq);
+int request_iov(struct request *rq, struct iovec **iov);
+void request_wrote(struct request *rq, size_t n);
+int request_pending(struct request *rq);
+int request_openfile(struct request *rq);
+void request_readfile(struct request *rq, int map);
 void request_set_data(struct request *rq, struct file_data *data);
 void request_sendfile(struct request *rq);
 void request_destroy(struct request *rq);
 
+/* for filling the cache without a request, see snapshot.h and server_warm().
+ * request_parse_URI sets data->file_name to the file that uri, len bytes
+ * long, asks for. request_make_header computes what request_readfile does
+ * once the file is in memory, for a file_buf filled some other way */
+void request_parse_URI(const char *uri, int len, struct file_data *data);
+void request_make_header(struct file_data *data, const char *file_buf);
+
 #endif
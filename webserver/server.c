@@ -1,51 +1,314 @@
 #include "common.h"
 #include "request.h"
 #include "server_thread.h"
+#include "policy.h"
+#include "cache.h"
+
+#define DEFAULT_ADMIT_THRESHOLD 16384
+#define DEFAULT_IDLE_TIMEOUT 5
+#define DEFAULT_REVALIDATE 5
 
 /* 
  * server.c: A very, very simple web server
  *
  * To run:
- *  server portnum nr_threads max_requests max_cache_size
+ *  server [-s nr_shards] [-p policy] [-a admission] [-A threshold]
+ *         [-z size] [-b backend] [-m mode] [-k timeout] [-r] [-c]
+ *         [-i nr_io_threads] [-w spill_size] [-v ttl] [-W list]
+ *         [-H hot_list] [-S snapshot]
+ *         portnum nr_threads max_requests max_cache_size
+ *
+ * -s splits the file cache into nr_shards independently locked shards
+ * (default 1), each getting max_cache_size / nr_shards bytes.
+ * -p picks the cache eviction policy (default lru).
+ * -a picks the cache admission filter (default all) and -A its threshold in
+ * bytes (default 16384), see cache.h.
+ * -z sends files of at least size bytes straight from disk with sendfile,
+ * without reading them into memory or caching them (default 0, no limit).
+ * Files that the cache does not admit are always sent this way.
+ * -b picks how cached files are stored, copied to the heap (heap, default) or
+ * mapped (mmap). Mapped files are charged to the cache for their resident
+ * pages only.
+ * -m picks how connections are served, see server_thread.h: by a pool of
+ * nr_threads blocking worker threads, each fed through its own queue of
+ * max_requests / nr_threads connections, rounded up (threads, default), or by
+ * nr_threads non-blocking epoll event loops (epoll), or by nr_threads
+ * io_uring workers that also accept the connections (uring). Both ignore
+ * max_requests. An idle worker thread steals from the queues of the others.
+ * -k closes persistent connections that stay idle for timeout seconds
+ * (default 5). HTTP/1.1 connections persist unless the client asks for them
+ * to be closed, HTTP/1.0 ones only if it asks with Connection: keep-alive.
+ * A client may pipeline its requests. With a timeout of 0, every connection
+ * is closed after one response. In the threads mode, a worker thread serves
+ * one connection at a time, until it is closed.
+ * -r makes each of the nr_threads workers accept its own connections on its
+ * own listening socket, bound to the port with SO_REUSEPORT, so that the
+ * kernel spreads the connections over them. Then no thread accepts for the
+ * others, and the threads mode has no queue: max_requests is ignored, and a
+ * worker leaves the connections waiting on its socket until it is done with
+ * the one it is serving.
+ * -c pins each worker thread to its own cpu, round robin.
+ * -i starts nr_io_threads threads that read the files missing from the cache
+ * (default 0), so that the epoll and uring workers go on serving the other
+ * connections meanwhile. The threads mode ignores it.
+ * -w gives the cache a warm tier of spill_size bytes on disk (default 0, none):
+ * files evicted from memory are compressed into a spill file in the current
+ * directory, and read back from there on a miss instead of from the slow
+ * disk. See spill.h.
+ * -v trusts a cached file for ttl seconds (default 5), after which the next
+ * hit checks with a stat that it has not changed on disk, and reads it again
+ * if it has. With a ttl of 0, every hit checks.
+ *
+ * -W reads the files named in list, e.g. fileset_dir.idx, into the cache in
+ * the background at startup, while the server serves requests.
+ * -H writes the names of the cached files to hot_list at shutdown, and reads
+ * them back in like -W at the next startup.
+ * -S saves the cached files to a snapshot file at shutdown, and restores them
+ * from there at the next startup, before serving any request. The restored
+ * files are mapped from the snapshot, whatever the backend. Files that have
+ * changed on disk since are left out. See snapshot.h.
+ *
+ * Responses carry an ETag, made from the size and checksum of the file, and
+ * its Last-Modified time. A request with If-None-Match or If-Modified-Since
+ * that matches them gets a 304 without the body.
  *
  * Repeatedly handles HTTP requests sent to this port number. Most of the work
  * is done within routines written in server_thread.c and request.c
+ *
+ * On SIGINT or SIGTERM, the server prints cache statistics to stderr and
+ * exits. The statistics include the average number of heap allocations made
+ * while serving a cache hit. It should be close to 0: only the first hits of
+ * a thread fill its slabs and arena. Compressing a file for the first client
+ * that accepts gzip is done once per file, like a miss, and is left out. In
+ * the threads mode, it also prints how many connections each worker thread
+ * served, how many of those it stole from the queues of the others, and how
+ * deep its queue got. With I/O threads, it prints how many misses were
+ * handed to them, and the most that waited for one at once. It also prints
+ * how many hits were checked against the disk and found stale, and, for each
+ * tier of the cache (memory, spill file and then disk), how many files were
+ * found there and how long it took to get one, and how many files were
+ * restored from the snapshot or warmed up. Then it saves the hot list and the
+ * snapshot.
  */
 
 void
 usage(char *program)
 {
-	fprintf(stderr, "Usage: %s port nr_threads max_requests "
-		"max_cache_size\n", program);
+	int i;
+
+	fprintf(stderr, "Usage: %s [-s nr_shards] [-p policy] [-a admission] "
+		"[-A threshold] [-z size] [-b backend] [-m mode] "
+		"[-k timeout] [-r] [-c] [-i nr_io_threads] [-w spill_size] "
+		"[-v ttl] [-W list] [-H hot_list] [-S snapshot] "
+		"port nr_threads max_requests max_cache_size\n",
+		program);
+	fprintf(stderr, "policies:");
+	for (i = 0; cache_policies[i]; i++)
+		fprintf(stderr, " %s", cache_policies[i]->name);
+	fprintf(stderr, "\nadmission filters:");
+	for (i = 0; cache_admissions[i]; i++)
+		fprintf(stderr, " %s", cache_admissions[i]);
+	fprintf(stderr, "\nbackends:");
+	for (i = 0; cache_backends[i]; i++)
+		fprintf(stderr, " %s", cache_backends[i]);
+	fprintf(stderr, "\nmodes:");
+	for (i = 0; server_modes[i]; i++)
+		fprintf(stderr, " %s", server_modes[i]);
+	fprintf(stderr, "\n");
 	exit(1);
 }
 
+/* waits for SIGINT or SIGTERM, which are blocked in all other threads */
+static void *
+signal_thread(void *sv_v)
+{
+	struct server *sv = (struct server *)sv_v;
+	sigset_t set;
+	int sig;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigwait(&set, &sig);
+
+	server_stats(sv, stderr);
+	server_save(sv, stderr);
+	exit(0);
+}
+
 int
 main(int argc, char *argv[])
 {
-	int port, nr_threads, max_requests, max_cache_size;
+	struct server_config cfg;
+	struct rlimit rl;
+	int port;
+	int c;
 	int listenfd, connfd, clientlen;
 	struct sockaddr_in clientaddr;
 	struct server *sv;
+	sigset_t set;
+	pthread_t t;
 
-	if (argc != 5)
+	cfg.mode = SERVER_THREADS;
+	cfg.nr_shards = 1;
+	cfg.policy = cache_policies[0];
+	cfg.admission = ADMIT_ALL;
+	cfg.admit_threshold = DEFAULT_ADMIT_THRESHOLD;
+	cfg.zero_copy_size = 0;
+	cfg.backend = CACHE_HEAP;
+	cfg.idle_timeout = DEFAULT_IDLE_TIMEOUT;
+	cfg.reuseport = 0;
+	cfg.pin = 0;
+	cfg.nr_io_threads = 0;
+	cfg.spill_size = 0;
+	cfg.revalidate = DEFAULT_REVALIDATE;
+	cfg.warm_list = NULL;
+	cfg.hot_list = NULL;
+	cfg.snapshot = NULL;
+	while ((c = getopt(argc, argv, "s:p:a:A:z:b:m:k:rci:w:v:W:H:S:")) != -1) {
+		switch (c) {
+		case 's':
+			cfg.nr_shards = atoi(optarg);
+			break;
+		case 'p':
+			cfg.policy = cache_policy_find(optarg);
+			if (!cfg.policy) {
+				fprintf(stderr, "unknown policy %s\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case 'a':
+			cfg.admission = cache_admission_find(optarg);
+			if (cfg.admission < 0) {
+				fprintf(stderr, "unknown admission filter %s\n",
+					optarg);
+				usage(argv[0]);
+			}
+			break;
+		case 'A':
+			cfg.admit_threshold = atoi(optarg);
+			break;
+		case 'z':
+			cfg.zero_copy_size = atoi(optarg);
+			break;
+		case 'm':
+			cfg.mode = server_mode_find(optarg);
+			if (cfg.mode < 0) {
+				fprintf(stderr, "unknown mode %s\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case 'b':
+			cfg.backend = cache_backend_find(optarg);
+			if (cfg.backend < 0) {
+				fprintf(stderr, "unknown backend %s\n", optarg);
+				usage(argv[0]);
+			}
+			break;
+		case 'k':
+			cfg.idle_timeout = atoi(optarg);
+			break;
+		case 'r':
+			cfg.reuseport = 1;
+			break;
+		case 'c':
+			cfg.pin = 1;
+			break;
+		case 'i':
+			cfg.nr_io_threads = atoi(optarg);
+			break;
+		case 'w':
+			cfg.spill_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			cfg.revalidate = atoi(optarg);
+			break;
+		case 'W':
+			cfg.warm_list = optarg;
+			break;
+		case 'H':
+			cfg.hot_list = optarg;
+			break;
+		case 'S':
+			cfg.snapshot = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 4)
 		usage(argv[0]);
-	port = atoi(argv[1]);
-	nr_threads = atoi(argv[2]);
-	max_requests = atoi(argv[3]);
-	max_cache_size = atoi(argv[4]);
+	port = atoi(argv[optind]);
+	cfg.nr_threads = atoi(argv[optind + 1]);
+	cfg.max_requests = atoi(argv[optind + 2]);
+	cfg.max_cache_size = atoi(argv[optind + 3]);
 	if (port < 1024) {
 		fprintf(stderr, "port = %d, should be >= 1024\n", port);
 		usage(argv[0]);
 	}
-	if (nr_threads < 0 || max_requests < 0 || max_cache_size < 0) {
+	if (cfg.nr_threads < 0 || cfg.max_requests < 0 ||
+	    cfg.max_cache_size < 0) {
 		fprintf(stderr, "arguments should be > 0\n");
 		usage(argv[0]);
 	}
+	if (cfg.admit_threshold < 1) {
+		fprintf(stderr, "threshold = %d, should be >= 1\n",
+			cfg.admit_threshold);
+		usage(argv[0]);
+	}
+	if (cfg.zero_copy_size < 0) {
+		fprintf(stderr, "size = %d, should be >= 0\n",
+			cfg.zero_copy_size);
+		usage(argv[0]);
+	}
+	if (cfg.idle_timeout < 0) {
+		fprintf(stderr, "timeout = %d, should be >= 0\n",
+			cfg.idle_timeout);
+		usage(argv[0]);
+	}
+	if (cfg.revalidate < 0) {
+		fprintf(stderr, "ttl = %d, should be >= 0\n", cfg.revalidate);
+		usage(argv[0]);
+	}
+	if (cfg.nr_io_threads < 0) {
+		fprintf(stderr, "nr_io_threads = %d, should be >= 0\n",
+			cfg.nr_io_threads);
+		usage(argv[0]);
+	}
+	if (cfg.mode == SERVER_THREADS && !cfg.reuseport &&
+	    cfg.nr_threads > 0 && cfg.max_requests < 1) {
+		fprintf(stderr, "max_requests = %d, should be >= 1\n",
+			cfg.max_requests);
+		usage(argv[0]);
+	}
+	if (cfg.nr_shards < 1) {
+		fprintf(stderr, "nr_shards = %d, should be >= 1\n",
+			cfg.nr_shards);
+		usage(argv[0]);
+	}
+
+	/* block the signals before any thread is created, so that only
+	 * signal_thread receives them */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	/* a client that goes away makes writes fail with EPIPE instead */
+	signal(SIGPIPE, SIG_IGN);
+	/* each connection needs a descriptor, allow as many as we may */
+	SYS(getrlimit(RLIMIT_NOFILE, &rl));
+	rl.rlim_cur = rl.rlim_max;
+	SYS(setrlimit(RLIMIT_NOFILE, &rl));
 
-	sv = server_init(nr_threads, max_requests, max_cache_size);
+	sv = server_init(&cfg);
+	SYS(pthread_create(&t, NULL, signal_thread, sv));
 
-	listenfd = open_listenfd(port);
+	if (cfg.mode == SERVER_URING || cfg.reuseport) {
+		server_listen(sv, port);
+		while (1)
+			pause();
+	}
+	listenfd = open_listenfd(port, 0);
 	while (1) {
 		clientlen = sizeof(clientaddr);
 		SYS(connfd = accept(listenfd, (struct sockaddr *)&clientaddr,
@@ -1,650 +1,1468 @@
+/* for pthread_setaffinity_np and accept4 */
+#define _GNU_SOURCE
 #include <pthread.h> 
+#include <sys/eventfd.h>
 #include "request.h"
 #include "server_thread.h"
 #include "common.h"
+#include "debug.h"
+#include "cache.h"
+#include "epoch.h"
+#include "uring.h"
+#include "list.h"
+#include "steal.h"
+#include "http.h"
+#include "arena.h"
+#include "iopool.h"
+#include "snapshot.h"
+
+/* threads that warm the cache up without I/O threads, see server_warm */
+#define WARM_THREADS 4
+
+/* the request heads read from a connection. a client may pipeline requests,
+ * so more than one may be buffered. the first one is parsed as it arrives */
+struct head {
+	int len;			/* bytes read so far */
+	struct http_parser parser;	/* of the first head */
+	char buf[MAXLINE];
+};
 
-/* circular Q header */
+/* a worker thread of the threads mode. it serves the connections that
+ * server_request hands out, or with reuseport, accepts its own on listenfd,
+ * see server_listen */
+struct pool_worker {
+	struct server *sv;
+	int id;
+	int listenfd;
+	struct head head;	/* of the connection being served */
+	struct arena arena;	/* for its current request */
+};
 
-typedef struct {
-	int *q;
-	unsigned start, end, max_q_size_plus_one;
-} circular_q;
+void *worker(void *w_v);
+void *acceptor(void *w_v);
 
-void q_init (      circular_q *q, unsigned max_size);
-int  q_full (const circular_q *q);
-int  q_empty(const circular_q *q);
-int  q_size (const circular_q *q);
-void q_print(const circular_q *q);
-void q_enq  (      circular_q *q, int a);
-int  q_deq  (      circular_q *q);
+const char *server_modes[] = { "threads", "epoll", "uring", NULL };
 
-/* cache header */
+/* where the data of a file comes from: the cache in memory, the warm tier of
+ * the cache on disk (see spill.h), or the file itself */
+enum { TIER_MEMORY, TIER_SPILL, TIER_DISK, NR_TIERS };
 
-#ifdef DEBUG
-#define BUCKETS 2
-#else
-#define BUCKETS 1000
-#endif
+static const char *server_tiers[] = { "memory", "spill", "disk" };
 
-typedef struct node_ {
-	struct file_data *data;
-	int reading;
-	struct node_ *next;
-} node;
+/* epoll reactor header */
 
-node *make_node(struct file_data *data, node *next);
-unsigned long hash(const char *str, int len);
+#define REACTOR_EVENTS 64
 
-node *cache_lookup(struct file_data *data);
-node *cache_insert(struct file_data *data);
-node *cache_lookup_or_insert(struct file_data *data);
-int   cache_delete(struct file_data *data);
-int   cache_evict (int amount);
-void  cache_print ();
+struct reactor {
+	struct server *sv;
+	int epfd;
+	struct list_head conns;	/* by last activity, the oldest first */
+	pthread_mutex_t lock;
+	struct list_head added;	/* handed over by reactor_add, under lock */
+	int listenfd;		/* its own listening socket, or -1 */
+};
 
-typedef struct lru_node_ {
-	struct file_data *data;
-	struct lru_node_ *next;
-} lru_node;
-
-lru_node *make_lru_node(struct file_data *data, lru_node *next);
-void lru_use(struct file_data *data);
-void lru_print();
-
-/* debug */
-int pthread_t_to_small_int(pthread_t pt);
-#define ZEROING_FREE(X)                         \
-    if (X) memset(X, 0, sizeof(*X));            \
-    free(X);                                    \
-    X = NULL;
-#define ZEROING_FREE_STR(X)                     \
-    if (X) memset(X, 0, strlen(X));             \
-    free(X);                                    \
-    X = NULL;
+/* a connection owned by a reactor */
+struct conn {
+	struct reactor *r;
+	int fd;
+	struct request *rq;	/* NULL while the request is being read */
+	struct file_data *data;	/* the data rq sends */
+	int writing;		/* waiting for the socket to take more */
+	int owned;		/* taken over by the reactor, see reactor_take */
+	int loading;		/* on an I/O thread, see conn_defer */
+	struct iopool_job job;
+	struct list_head list;	/* on the reactor's conns, or added */
+	long active;		/* when the connection was last active, in ms */
+	struct head head;
+	struct arena arena;	/* for the current request */
+};
 
-#ifdef DEBUG
-#define DEBUG_PRINT(FMT, ...)											\
-printf("%d|" FMT "\n", pthread_t_to_small_int(pthread_self()), __VA_ARGS__)
-#define FREE(X) ZEROING_FREE(X)
-#define FREE_STR(X) ZEROING_FREE_STR(X)
-#else
-#define DEBUG_PRINT(FMT, ...)
-#define FREE(X) free(X)
-#define FREE_STR(X) free(X)
-#endif
+void *reactor(void *r_v);
+static void reactor_add(struct reactor *r, int connfd);
+static void reactor_listen(struct reactor *r, int listenfd);
 
-/* globals */
-pthread_t *threads;
+/* io_uring worker header */
 
-circular_q req_q;
-pthread_mutex_t req_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t req_full = PTHREAD_COND_INITIALIZER;
-pthread_cond_t req_empty = PTHREAD_COND_INITIALIZER;
+#define URING_ENTRIES 256
 
-node **cache_buckets = NULL;
-unsigned cache_usage = 0;
-pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+struct uworker {
+	struct server *sv;
+	struct uring ring;
+	int listenfd;
+	struct __kernel_timespec idle;	/* for the linked recv timeouts */
+	int loadfd;			/* an eventfd, see uconn_load */
+	pthread_mutex_t lock;
+	struct list_head loaded;	/* back from the I/O threads, under
+					 * lock */
+};
 
-lru_node *lru_list_head = NULL;
+/* a connection owned by a uworker. the completions for it carry its address,
+ * those for the accept carry the uworker's, and those for the poll of loadfd
+ * carry the address of loadfd */
+struct uconn {
+	struct uworker *w;
+	int fd;
+	struct request *rq;	/* NULL while the request is being read */
+	struct file_data *data;	/* the data rq sends */
+	int polling;		/* sending the file, waiting for the socket */
+	struct msghdr msg;	/* read by the kernel until the send completes */
+	struct head head;
+	struct arena arena;	/* for the current request */
+	struct iopool_job job;
+	struct list_head list;	/* on the uworker's loaded */
+};
 
-void *worker(void *sv_v);
+void *uworker(void *w_v);
 
 struct server {
+	int mode;
 	int nr_threads;
 	int max_requests;
 	int max_cache_size;
+	int nr_shards;
+	int zero_copy_size;
+	int backend;
+	int idle_timeout;
+	int reuseport;
+	int pin;
+	int revalidate;			/* seconds before a hit is checked */
+	const char *hot_list;		/* saved at shutdown, or NULL */
+	const char *snapshot;		/* saved at shutdown, or NULL */
+	struct iopool *io;		/* NULL without I/O threads */
+	struct iopool *warm_io;		/* for server_warm without them */
+	unsigned long zero_copy;	/* files sent from disk */
+	unsigned long hits;		/* requests served from the cache */
+	unsigned long hit_mallocs;	/* Malloc calls made serving them */
+	unsigned long revalidated;	/* hits checked against the disk */
+	unsigned long stale;		/* hits found changed on disk */
+	int restored;			/* files restored from the snapshot */
+	unsigned long warmed;		/* files read in by server_warm */
+	unsigned long tier_files[NR_TIERS];	/* found in each tier */
+	unsigned long tier_ns[NR_TIERS];	/* time taken to get them */
+	struct reactor *reactors;	/* nr_threads of them */
+	unsigned next_reactor;		/* gets the next connection */
+	struct uworker *uworkers;	/* nr_threads of them */
+	struct steal *requests;		/* connections for the worker threads */
 };
 
 /* static functions */
 
-/* initialize file data */
-static struct file_data *
-file_data_init(void)
+/* pins the i-th worker thread t to a cpu, if asked to. the workers are spread
+ * over the cpus that the server may run on */
+static void
+server_pin(struct server *sv, pthread_t t, int i)
 {
-	struct file_data *data;
+	cpu_set_t allowed, set;
+	int cpu, n;
 
-	data = Malloc(sizeof(struct file_data));
-	data->file_name = NULL;
-	data->file_buf = NULL;
-	data->file_size = 0;
-	return data;
+	if (!sv->pin)
+		return;
+	SYS(sched_getaffinity(0, sizeof(allowed), &allowed));
+	n = i % CPU_COUNT(&allowed);
+	for (cpu = 0; n > 0 || !CPU_ISSET(cpu, &allowed); cpu++) {
+		if (CPU_ISSET(cpu, &allowed))
+			n--;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(t, sizeof(set), &set)) {
+		unix_error("pthread_setaffinity_np error");
+	}
 }
 
-/* free all file data */
 static void
-file_data_free(struct file_data *data)
+head_init(struct head *h)
 {
-	FREE_STR(data->file_name);
-#ifdef DEBUG
-	if (data->file_buf) {
-		memset(data->file_buf, 0, data->file_size);
-	}
-#endif
-	free(data->file_buf);
+	h->len = 0;
+	http_parser_init(&h->parser);
+}
 
-	FREE(data);
+/* parses what has arrived of the first request head. returns its length, up
+ * to and including the empty line that ends it, or 0 if it has not all
+ * arrived */
+static int
+head_end(struct head *h)
+{
+	return http_parse(&h->parser, h->buf, h->len);
+}
+
+/* whether the buffer is full, without a complete head in it. a head is only
+ * a few short lines, so the client is not sending one */
+static int
+head_full(struct head *h)
+{
+	return h->len == sizeof(h->buf);
 }
 
+/* drops the first head, n bytes long, which has been served. pipelined
+ * requests that follow move to the front */
 static void
-do_server_request(struct server *sv, int connfd)
+head_consume(struct head *h, int n)
 {
-	int ret;
-	struct request *rq;
-	struct file_data *data;
+	memmove(h->buf, h->buf + n, h->len - n);
+	h->len -= n;
+	http_parser_init(&h->parser);
+}
 
-	data = file_data_init();
+/* in nanoseconds, for the tier latencies */
+static long
+now_ns(void)
+{
+	struct timespec ts;
 
-	/* fills data->file_name with name of the file being requested */
-	rq = request_init(connfd, data);
-	if (!rq) {
-		file_data_free(data);
-		return;
+	SYS(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* in milliseconds, for the idle timeouts */
+static long
+now_ms(void)
+{
+	return now_ns() / 1000000;
+}
+
+/* counts a file found in tier, which took since start to get */
+static void
+server_tier(struct server *sv, int tier, long start)
+{
+	__atomic_add_fetch(&sv->tier_files[tier], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sv->tier_ns[tier], now_ns() - start,
+			   __ATOMIC_RELAXED);
+}
+
+/* whether the cached data found by a hit has changed on disk since it was
+ * read. it is checked with a stat, at most once every sv->revalidate seconds,
+ * by the one hit that claims the check. a stale file is taken out of the
+ * cache, the caller drops its reference and reads the file again */
+static int
+server_stale(struct server *sv, cache_shard *sh, struct file_data *data,
+	     long start)
+{
+	long now = start / 1000000000L;
+	long checked = __atomic_load_n(&data->checked, __ATOMIC_RELAXED);
+	struct stat sbuf;
+
+	if (now - checked < sv->revalidate)
+		return 0;
+	if (!__atomic_compare_exchange_n(&data->checked, &checked, now, 0,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return 0;
+	__atomic_add_fetch(&sv->revalidated, 1, __ATOMIC_RELAXED);
+	if (stat(data->file_name, &sbuf) == 0 &&
+	    sbuf.st_mtime == data->file_mtime &&
+	    sbuf.st_size == data->file_size)
+		return 0;
+	DEBUG_PRINT("%s changed on disk", data->file_name);
+	__atomic_add_fetch(&sv->stale, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&sh->lock);
+	cache_remove(sh, data);
+	pthread_mutex_unlock(&sh->lock);
+	return 1;
+}
+
+/* the reader of a miss on data, which has the flight f: reads the file of rq
+ * into data and inserts it into the cache, then finishes f. a file evicted to
+ * the warm tier is read back from there. files that will not be cached are
+ * not read, the admission filter only needs the size. returns 0 if the file
+ * could not be opened, after staging the error. *tier is where the file was
+ * found if it was cached, or -1 */
+static int
+server_fill(struct server *sv, cache_shard *sh, struct request *rq,
+	    struct file_data *data, struct flight *f, int *tier)
+{
+	int ret, admit, spilled;
+
+	spilled = cache_unspill(data);
+	ret = spilled || request_openfile(rq);
+	admit = spilled;
+	if (!spilled && ret && (!sv->zero_copy_size ||
+				data->file_size < sv->zero_copy_size)) {
+		pthread_mutex_lock(&sh->lock);
+		admit = cache_admit(sh, data);
+		pthread_mutex_unlock(&sh->lock);
+	}
+	if (admit && !spilled) {
+		DEBUG_PRINT("reading file %s", data->file_name);
+		request_readfile(rq, sv->backend == CACHE_MMAP);
+	}
+	*tier = -1;
+	if (admit) {
+		*tier = spilled ? TIER_SPILL : TIER_DISK;
+		/* both stat the file on the way */
+		data->checked = now_ns() / 1000000000L;
+		/* once the data is published, every request that finds it may
+		 * read the header at once, so it must not be built lazily. a
+		 * file read back from the warm tier, or an empty one, does not
+		 * get it from request_readfile */
+		if (!data->header)
+			request_make_header(data, data->file_buf);
 	}
-	DEBUG_PRINT("request for %s", data->file_name);
 
-	/* check cache for file */
-	pthread_mutex_lock(&cache_lock);
-	node *cached = cache_lookup(data);
-	if (cached) {
-		DEBUG_PRINT("cache hit, incrementing %d", cached->reading);
-		++cached->reading;
+	pthread_mutex_lock(&sh->lock);
+	if (admit) {
+		/* misses and server_warm alike, no request builds it later */
+		assert(data->header);
+		cache_insert(sh, data);
+	}
+	/* wakes up the waiters */
+	cache_flight_finish(sh, f, admit);
+	cache_unlock(sh);
+	return ret;
+}
 
-		lru_use(cached->data);
+/* looks up the file requested by rq in the cache, or reads it, and stages the
+ * response in rq. data is the request's own file data, which is replaced by
+ * the cached copy on a hit, and *hit is set. returns the data rq sends, the
+ * caller holds a reference to it and must keep it until the response has
+ * been written. if missed is not NULL, a file that is not found without
+ * taking a lock is not read: *missed is set and nothing is staged, and the
+ * caller hands the request to the I/O threads, which call this again */
+static struct file_data *
+server_respond(struct server *sv, struct request *rq, struct file_data *data,
+	       int *hit, int *missed)
+{
+	int ret, tier;
+	struct file_data *shared;
+	struct flight *f;
+	long start = now_ns();
 
-		free(data->file_name);
-		data->file_name = cached->data->file_name;
-		data->file_buf = cached->data->file_buf;
-		data->file_size = cached->data->file_size;
+	DEBUG_PRINT("request for %s", data->file_name);
+	if (!sv->idle_timeout) {
+		request_set_keep_alive(rq, 0);
+	}
 
-		pthread_mutex_unlock(&cache_lock);
-		request_sendfile(rq);
-		pthread_mutex_lock(&cache_lock);
+	/* check cache for file without taking a lock. the data found must be
+	 * referenced before leaving the epoch */
+	cache_shard *sh = cache_shard_for(data->file_name);
+	shared = NULL;
+	epoch_enter();
+	node *cached = cache_lookup(sh, data);
+	if (cached) {
+		shared = file_data_get(cached->data);
+		cache_touch_nolock(sh, cached);
+	}
+	epoch_exit();
 
-		DEBUG_PRINT("cache hit, decrementing %d", cached->reading);
-		assert(cached->reading > 0);
-		--cached->reading;
+	if (shared && server_stale(sv, sh, shared, start)) {
+		file_data_put(shared);
+		shared = NULL;
+	}
+	if (!shared && missed) {
+		DEBUG_PRINT("handing %s to the I/O threads", data->file_name);
+		*missed = 1;
+		return data;
+	}
+	if (!shared) {
+		/* only the shard holding this file is locked. the file may
+		 * have been inserted since we looked */
+		pthread_mutex_lock(&sh->lock);
+		cached = cache_lookup(sh, data);
+		if (cached) {
+			cache_touch(sh, cached);
+			shared = file_data_get(cached->data);
+			pthread_mutex_unlock(&sh->lock);
+		}
+		if (shared && server_stale(sv, sh, shared, start)) {
+			file_data_put(shared);
+			shared = NULL;
+			pthread_mutex_lock(&sh->lock);
+		}
+	}
 
-		FREE(data);
+	if (shared) {
+		DEBUG_PRINT("cache hit %s", data->file_name);
+		*hit = 1;
+		server_tier(sv, TIER_MEMORY, start);
 
-		pthread_mutex_unlock(&cache_lock);
+		/* send the cached data, it stays alive until we put it even if
+		 * it gets evicted in the meantime */
+		file_data_put(data);
+		data = shared;
+		request_set_data(rq, data);
+		request_sendfile(rq);
 	} else {
-		pthread_mutex_unlock(&cache_lock);
+		/* still holding the shard lock */
+		cache_miss(sh, data);
+		f = cache_flight_find(sh, data);
+		if (f) {
+			/* another thread is reading this file, wait for it and
+			 * send its copy instead of reading the file again */
+			DEBUG_PRINT("waiting for file %s", data->file_name);
+			shared = cache_flight_wait(sh, f);
+			pthread_mutex_unlock(&sh->lock);
+
+			if (shared) {
+				file_data_put(data);
+				data = shared;
+				request_set_data(rq, data);
+				request_sendfile(rq);
+			} else if (request_openfile(rq)) {
+				/* the file was not read into memory, send it
+				 * from disk. if it could not be opened,
+				 * request_openfile staged the error */
+				__atomic_add_fetch(&sv->zero_copy, 1,
+						   __ATOMIC_RELAXED);
+				request_sendfile(rq);
+			}
+		} else {
+			f = cache_flight_start(sh, data);
+			pthread_mutex_unlock(&sh->lock);
 
-		DEBUG_PRINT("reading file %s", data->file_name);
-		ret = request_readfile(rq);
-		if (ret) {
-			int file_too_big_for_cache = 1;
-			pthread_mutex_lock(&cache_lock);
-			cached = cache_lookup(data);
-			if (cached) {
-				++cached->reading;
-				lru_use(data);
-			} else {
-				file_too_big_for_cache = data->file_size > sv->max_cache_size;
-				int evict_amount = cache_usage + data->file_size - sv->max_cache_size;
-
-				if (!file_too_big_for_cache && evict_amount > 0) {
-					/* adding would overfill cache, need to evict */
-					if (cache_evict(evict_amount) > 0) {
-						/* still have to evict but can't due to reading files */
-						file_too_big_for_cache = 1;
-					}
-				}
-				if (!file_too_big_for_cache) {
-					cached = cache_insert(data);
-					DEBUG_PRINT("cache miss, incrementing %d", cached->reading);
-					++cached->reading;
-					lru_use(data);
-				}
+			ret = server_fill(sv, sh, rq, data, f, &tier);
+			if (tier >= 0) {
+				server_tier(sv, tier, start);
 			}
-			pthread_mutex_unlock(&cache_lock);
-
-			DEBUG_PRINT("sending file %s", data->file_name);
-			request_sendfile(rq);
-
-			pthread_mutex_lock(&cache_lock);
-			cached = cache_lookup(data);
-			if (cached) {
-				if (!file_too_big_for_cache) {
-					/* I added to cache */
-					DEBUG_PRINT("cache miss, decrementing %d", cached->reading);
-					assert(cached->reading > 0);
-					--cached->reading;
+			if (ret) {
+				DEBUG_PRINT("sending file %s", data->file_name);
+				if (tier < 0) {
+					__atomic_add_fetch(&sv->zero_copy, 1,
+							   __ATOMIC_RELAXED);
 				}
-				pthread_mutex_unlock(&cache_lock);
-			} else {
-				pthread_mutex_unlock(&cache_lock);
-				file_data_free(data);
+				request_sendfile(rq);
 			}
-		} else {
-			file_data_free(data);
 		}
 	}
+	return data;
+}
 
-	request_destroy(rq);
+/* starts serving the request head at the front of h, end bytes long, on
+ * connfd: creates the request in arena, parses the head, and stages the
+ * response. returns the request, and the data it sends in *data. with
+ * missed, a cache miss is left to the I/O threads, see server_respond. counts
+ * the Malloc calls made for cache hits, which the slabs and arenas should
+ * keep at 0 once they are filled. compressing the file for the first client
+ * that accepts gzip happens once per file, like a miss, and is left out */
+static struct request *
+server_start(struct server *sv, int connfd, struct head *h, int end,
+	     struct arena *arena, struct file_data **data, int *missed)
+{
+	unsigned long mallocs = Malloc_calls();
+	struct request *rq;
+	int hit = 0;
+
+	if (missed)
+		*missed = 0;
+	*data = file_data_init();
+	rq = request_create(connfd, *data, arena);
+	/* fills data->file_name with name of the file being requested */
+	if (request_parse(rq, &h->parser, h->buf)) {
+		*data = server_respond(sv, rq, *data, &hit, missed);
+	}
+	head_consume(h, end);
+	if (hit) {
+		__atomic_add_fetch(&sv->hits, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&sv->hit_mallocs, Malloc_calls() - mallocs -
+				   request_gzip_mallocs(rq), __ATOMIC_RELAXED);
+	}
+	return rq;
+}
+
+/* reads from the blocking connfd until the first request head is in h.
+ * returns its length, or 0 if the connection is closed, or times out, or
+ * does not send a head */
+static int
+head_read(struct head *h, int connfd)
+{
+	int end, n;
+
+	while (!(end = head_end(h))) {
+		if (head_full(h))
+			return 0;
+		n = read(connfd, h->buf + h->len, sizeof(h->buf) - h->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		h->len += n;
+	}
+	return end;
+}
+
+/* serves the requests on connfd until the client closes it, asks for it to
+ * be closed, or leaves it idle for too long. the worker thread w is tied to
+ * the connection meanwhile, and serves the requests with its own buffer and
+ * arena */
+static void
+do_server_request(struct pool_worker *w, int connfd)
+{
+	struct server *sv = w->sv;
+	struct head *h = &w->head;
+	struct request *rq;
+	struct file_data *data;
+	struct timeval tv;
+	int keep_alive, end;
+
+	if (sv->idle_timeout) {
+		/* reading the next request fails once the timeout expires */
+		tv.tv_sec = sv->idle_timeout;
+		tv.tv_usec = 0;
+		SYS(setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+			       sizeof(tv)));
+	}
+	/* holds on to pipelined requests between the heads */
+	head_init(h);
+	while ((end = head_read(h, connfd))) {
+		rq = server_start(sv, connfd, h, end, &w->arena, &data, NULL);
+		/* the connection is blocking, so this writes all of the
+		 * response unless the client has gone away */
+		keep_alive = request_write(rq) == 1 && request_keep_alive(rq);
+
+		file_data_put(data);
+		request_destroy(rq);
+		arena_reset(&w->arena);
 
 #ifdef DEBUG
-	cache_print();
-	lru_print();
-	fflush(stdout);
+		cache_print();
+		fflush(stdout);
 #endif
+		if (!keep_alive)
+			break;
+	}
+	SYS(close(connfd));
+}
+
+/* a file that server_warm reads into the cache, on an I/O thread */
+struct warm {
+	struct server *sv;
+	char *uri;
+	struct arena arena;	/* for its request */
+	struct iopool_job job;
+};
+
+/* reads the file that uri asks for into the cache like a miss would, but
+ * stages no response. a file that is cached or being read already is left
+ * alone */
+static void
+server_warm_file(struct server *sv, struct arena *arena, const char *uri)
+{
+	struct file_data *data = file_data_init();
+	struct request *rq = request_create(-1, data, arena);
+	cache_shard *sh;
+	struct flight *f;
+	int tier;
+
+	request_parse_URI(uri, strlen(uri), data);
+	sh = cache_shard_for(data->file_name);
+	pthread_mutex_lock(&sh->lock);
+	if (cache_lookup(sh, data) || cache_flight_find(sh, data)) {
+		pthread_mutex_unlock(&sh->lock);
+	} else {
+		f = cache_flight_start(sh, data);
+		pthread_mutex_unlock(&sh->lock);
+		server_fill(sv, sh, rq, data, f, &tier);
+		if (tier >= 0) {
+			__atomic_add_fetch(&sv->warmed, 1, __ATOMIC_RELAXED);
+		}
+	}
+	request_destroy(rq);
+	file_data_put(data);
+}
+
+static void
+warm_load(struct iopool_job *job)
+{
+	struct warm *w = container_of(job, struct warm, job);
+
+	server_warm_file(w->sv, &w->arena, w->uri);
+	arena_destroy(&w->arena);
+	free(w->uri);
+	free(w);
+}
+
+/* reads the files listed at path into the cache in the background, while the
+ * server starts serving, on the I/O threads, or on WARM_THREADS threads of
+ * their own if there are none. a line names a file by the URI that asks for
+ * it, and only its first word counts, so both the hot list that server_save
+ * writes and fileset_dir.idx will do. names that are not files are skipped.
+ * returns 0 if the list could not be opened */
+static int
+server_warm(struct server *sv, const char *path)
+{
+	char line[MAXLINE], *name, *save;
+	struct iopool *io = sv->io ? sv->io : sv->warm_io;
+	struct warm *w;
+	FILE *in;
+
+	in = fopen(path, "r");
+	if (!in)
+		return 0;
+	if (!io) {
+		io = sv->warm_io = iopool_init(WARM_THREADS);
+	}
+	while (fgets(line, sizeof(line), in)) {
+		name = strtok_r(line, " \t\r\n", &save);
+		if (!name)
+			continue;
+		w = Malloc(sizeof(struct warm));
+		w->sv = sv;
+		w->uri = Malloc(strlen(name) + 1);
+		strcpy(w->uri, name);
+		arena_init(&w->arena);
+		w->job.run = warm_load;
+		iopool_submit(io, &w->job);
+	}
+	fclose(in);
+	return 1;
+}
+
+static void
+server_save_uri(struct file_data *data, void *out_v)
+{
+	/* without the ./ that request_parse_URI put in front */
+	fprintf((FILE *)out_v, "%s\n", data->file_name + 2);
 }
 
 /* entry point functions */
 
 struct server *
-server_init(int nr_threads, int max_requests, int max_cache_size)
+server_init(const struct server_config *cfg)
 {
 	struct server *sv;
 
 	sv = Malloc(sizeof(struct server));
-	sv->nr_threads = nr_threads;
-	sv->max_requests = max_requests;
-	sv->max_cache_size = max_cache_size;
-
-	q_init(&req_q, max_requests);
+	sv->mode = cfg->mode;
+	sv->nr_threads = cfg->nr_threads;
+	sv->max_requests = cfg->max_requests;
+	sv->max_cache_size = cfg->max_cache_size;
+	sv->nr_shards = cfg->nr_shards;
+	sv->zero_copy_size = cfg->zero_copy_size;
+	sv->backend = cfg->backend;
+	sv->idle_timeout = cfg->idle_timeout;
+	sv->reuseport = cfg->reuseport;
+	sv->pin = cfg->pin;
+	sv->revalidate = cfg->revalidate;
+	sv->hot_list = cfg->hot_list;
+	sv->snapshot = cfg->snapshot;
+	sv->io = NULL;
+	sv->warm_io = NULL;
+	sv->zero_copy = 0;
+	sv->hits = 0;
+	sv->hit_mallocs = 0;
+	sv->revalidated = 0;
+	sv->stale = 0;
+	sv->restored = 0;
+	sv->warmed = 0;
+	memset(sv->tier_files, 0, sizeof(sv->tier_files));
+	memset(sv->tier_ns, 0, sizeof(sv->tier_ns));
+	sv->requests = NULL;
 
-	threads = malloc(sizeof(pthread_t) * nr_threads);
+	/* cache */
+	cache_init(cfg->nr_shards, cfg->max_cache_size, cfg->policy,
+		   cfg->admission, cfg->admit_threshold, cfg->spill_size);
+
+	if (cfg->nr_io_threads > 0 && sv->mode != SERVER_THREADS)
+		sv->io = iopool_init(cfg->nr_io_threads);
+
+	/* the snapshot is restored before any request is served, the lists
+	 * are read in meanwhile. a hot list or snapshot that is not there yet
+	 * is written at shutdown */
+	if (sv->snapshot)
+		sv->restored = snapshot_restore(sv->snapshot);
+	if (sv->hot_list)
+		server_warm(sv, sv->hot_list);
+	if (cfg->warm_list && !server_warm(sv, cfg->warm_list))
+		unix_error("could not open the warm list");
 
 	int i;
-	for (i = 0; i < nr_threads; ++i) {
+	if (sv->mode == SERVER_EPOLL) {
+		/* connections are spread over the reactors, each running its
+		 * own event loop in its own thread */
+		if (sv->nr_threads == 0)
+			sv->nr_threads = 1;
+		sv->reactors = Malloc(sizeof(struct reactor) * sv->nr_threads);
+		sv->next_reactor = 0;
+		threads = malloc(sizeof(pthread_t) * sv->nr_threads);
+		for (i = 0; i < sv->nr_threads; ++i) {
+			struct reactor *r = &sv->reactors[i];
+
+			r->sv = sv;
+			SYS(r->epfd = epoll_create1(0));
+			INIT_LIST_HEAD(&r->conns);
+			pthread_mutex_init(&r->lock, NULL);
+			INIT_LIST_HEAD(&r->added);
+			r->listenfd = -1;
+			SYS(pthread_create(&threads[i], NULL, &reactor, r));
+			server_pin(sv, threads[i], i);
+		}
+		return sv;
+	}
+	if (sv->mode == SERVER_URING || sv->reuseport) {
+		/* the workers are started by server_listen */
+		if (sv->nr_threads == 0)
+			sv->nr_threads = 1;
+		return sv;
+	}
+
+	if (sv->nr_threads > 0)
+		sv->requests = steal_init(sv->nr_threads, sv->max_requests);
+
+	threads = malloc(sizeof(pthread_t) * sv->nr_threads);
+
+	for (i = 0; i < sv->nr_threads; ++i) {
+		struct pool_worker *w = Malloc(sizeof(struct pool_worker));
 		pthread_t t;
-		int ret = pthread_create(&t, NULL, &worker, sv);
+		int ret;
+
+		w->sv = sv;
+		w->id = i;
+		w->listenfd = -1;
+		arena_init(&w->arena);
+		ret = pthread_create(&t, NULL, &worker, w);
 		assert(!ret);
 		threads[i] = t;
+		server_pin(sv, t, i);
 	}
 
-	/* cache */
-	cache_buckets = (node **) calloc(BUCKETS, sizeof(node *));
-	assert(cache_buckets);
-
 	return sv;
 }
 
+int
+server_mode_find(const char *name)
+{
+	int i;
+
+	for (i = 0; server_modes[i]; i++) {
+		if (!strcmp(server_modes[i], name))
+			return i;
+	}
+	return -1;
+}
+
 void
 server_request(struct server *sv, int connfd)
 {
-	if (sv->nr_threads == 0) { /* no worker threads */
-		do_server_request(sv, connfd);
+	if (sv->mode == SERVER_EPOLL) {
+		reactor_add(&sv->reactors[sv->next_reactor++ % sv->nr_threads],
+			    connfd);
+	} else if (sv->nr_threads == 0) { /* no worker threads */
+		/* zeroed, like arena_init would */
+		static struct pool_worker main_worker;
+
+		main_worker.sv = sv;
+		do_server_request(&main_worker, connfd);
 	} else {
-		// produce
-		pthread_mutex_lock(&req_lock);
-
-		while (q_full(&req_q)) {
-			pthread_cond_wait(&req_full, &req_lock);
-		}
-
-		q_enq(&req_q, connfd);
-
-		if (!q_empty(&req_q)) {
-			pthread_cond_signal(&req_empty);
-		}
-
-		pthread_mutex_unlock(&req_lock);
+		steal_push(sv->requests, connfd);
 	}
 }
 
-void *worker(void *sv_v)
+/* in SERVER_URING mode, or with reuseport set, the workers accept the
+ * connections on port themselves. with reuseport, each has its own listening
+ * socket. returns once they are running */
+void
+server_listen(struct server *sv, int port)
 {
-	struct server *sv = (struct server *) sv_v;
-	while (1) {
-		// consume
-		pthread_mutex_lock(&req_lock);
+	int listenfd = -1;
+	int i;
 
-		while (q_empty(&req_q)) {
-			pthread_cond_wait(&req_empty, &req_lock);
+	assert(sv->mode == SERVER_URING || sv->reuseport);
+	if (!sv->reuseport)
+		listenfd = open_listenfd(port, 0);
+	if (sv->mode == SERVER_EPOLL) {
+		/* the reactors are already running */
+		for (i = 0; i < sv->nr_threads; ++i) {
+			reactor_listen(&sv->reactors[i],
+				       open_listenfd(port, 1));
 		}
-
-		int fd = q_deq(&req_q);
-
-		if (!q_full(&req_q)) {
-			pthread_cond_signal(&req_full);
+		return;
+	}
+	if (sv->mode == SERVER_URING) {
+		sv->uworkers = Malloc(sizeof(struct uworker) * sv->nr_threads);
+	}
+	threads = malloc(sizeof(pthread_t) * sv->nr_threads);
+	for (i = 0; i < sv->nr_threads; ++i) {
+		if (sv->reuseport)
+			listenfd = open_listenfd(port, 1);
+		if (sv->mode == SERVER_URING) {
+			struct uworker *w = &sv->uworkers[i];
+
+			w->sv = sv;
+			w->listenfd = listenfd;
+			w->idle.tv_sec = sv->idle_timeout;
+			w->idle.tv_nsec = 0;
+			SYS(w->loadfd = eventfd(0, EFD_NONBLOCK));
+			pthread_mutex_init(&w->lock, NULL);
+			INIT_LIST_HEAD(&w->loaded);
+			if (uring_init(&w->ring, URING_ENTRIES) < 0) {
+				unix_error("io_uring_setup error");
+			}
+			SYS(pthread_create(&threads[i], NULL, &uworker, w));
+		} else {
+			struct pool_worker *pw =
+				Malloc(sizeof(struct pool_worker));
+
+			pw->sv = sv;
+			pw->id = i;
+			pw->listenfd = listenfd;
+			arena_init(&pw->arena);
+			SYS(pthread_create(&threads[i], NULL, &acceptor, pw));
 		}
-
-		pthread_mutex_unlock(&req_lock);
-
-		do_server_request(sv, fd);
+		server_pin(sv, threads[i], i);
 	}
-
-	return NULL;
 }
 
-/* cache implementation */
-
-node *
-make_node(struct file_data *data, node *next)
+void
+server_stats(struct server *sv, FILE *out)
 {
-	node *newnode = (node *) malloc(sizeof(node));
-	assert(newnode);
+	/* the workers may still be counting, each counter is read once */
+	unsigned long hits = __atomic_load_n(&sv->hits, __ATOMIC_RELAXED);
+	unsigned long hit_mallocs = __atomic_load_n(&sv->hit_mallocs,
+						    __ATOMIC_RELAXED);
+	unsigned long tier_files[NR_TIERS], tier_ns[NR_TIERS];
+	unsigned long files = 0;
+	int i;
 
-	newnode->data = data;
-	newnode->reading = 0;
-	newnode->next = next;
-	return newnode;
+	fprintf(out, "cache backend = %s\n", cache_backends[sv->backend]);
+	cache_stats(out);
+	fprintf(out, "files sent from disk = %lu\n",
+		__atomic_load_n(&sv->zero_copy, __ATOMIC_RELAXED));
+	fprintf(out, "heap allocations per cache hit = %.2f (%lu hits)\n",
+		hits ? (double)hit_mallocs / hits : 0.0, hits);
+	fprintf(out, "hits revalidated = %lu, stale = %lu\n",
+		__atomic_load_n(&sv->revalidated, __ATOMIC_RELAXED),
+		__atomic_load_n(&sv->stale, __ATOMIC_RELAXED));
+	fprintf(out, "files restored from snapshot = %d, warmed = %lu\n",
+		sv->restored, __atomic_load_n(&sv->warmed, __ATOMIC_RELAXED));
+	/* the files found in the cache or read into it, and how long it took
+	 * to get each. a tier only sees the misses of the one above */
+	for (i = 0; i < NR_TIERS; i++) {
+		tier_files[i] = __atomic_load_n(&sv->tier_files[i],
+						__ATOMIC_RELAXED);
+		tier_ns[i] = __atomic_load_n(&sv->tier_ns[i],
+					     __ATOMIC_RELAXED);
+		files += tier_files[i];
+	}
+	for (i = 0; i < NR_TIERS; i++) {
+		fprintf(out, "tier %s = %lu files (%.4f), %.1f us each\n",
+			server_tiers[i], tier_files[i],
+			files ? (double)tier_files[i] / files : 0.0,
+			tier_files[i] ? tier_ns[i] / 1e3 / tier_files[i] : 0.0);
+	}
+	if (sv->io)
+		iopool_stats(sv->io, out);
+	if (sv->requests)
+		steal_stats(sv->requests, out);
 }
 
-/* djb2 string hash algorithm from http://www.cse.yorku.ca/~oz/hash.html */ 
-unsigned long
-hash(const char *str, int len)
+void
+server_save(struct server *sv, FILE *out)
 {
-	unsigned long hash = 5381;
-	int i;
+	FILE *hot;
+
+	if (sv->hot_list) {
+		hot = fopen(sv->hot_list, "w");
+		if (!hot)
+			unix_error("could not write the hot list");
+		cache_foreach(server_save_uri, hot);
+		fclose(hot);
+		fprintf(out, "hot list saved to %s\n", sv->hot_list);
+	}
+	if (sv->snapshot) {
+		fprintf(out, "snapshot of %d files saved to %s\n",
+			snapshot_save(sv->snapshot), sv->snapshot);
+	}
+}
 
-	for (i = 0; i < len; ++i) {
-		hash = ((hash << 5) + hash) + str[i]; /* hash * 33 + c */
+void *worker(void *w_v)
+{
+	struct pool_worker *w = (struct pool_worker *) w_v;
+	while (1) {
+		do_server_request(w, steal_pop(w->sv->requests, w->id));
 	}
 
-	return hash;
+	return NULL;
 }
 
-node *
-cache_lookup(struct file_data *data)
+void *acceptor(void *w_v)
 {
-	assert(data);
-	assert(data->file_name);
-	int len = strlen(data->file_name);
-	int hash_in_bucket = hash(data->file_name, len) % BUCKETS;
-
-	node *curr = cache_buckets[hash_in_bucket];
+	struct pool_worker *w = (struct pool_worker *) w_v;
+	int connfd;
 
-	while (curr) {
-		if (!strncmp(curr->data->file_name, data->file_name, len)) {
-			return curr;
-		}
-		curr = curr->next;
+	while (1) {
+		connfd = accept(w->listenfd, NULL, NULL);
+		if (connfd < 0 && (errno == EINTR || errno == ECONNABORTED))
+			continue;
+		SYS(connfd);
+		do_server_request(w, connfd);
 	}
+
 	return NULL;
 }
 
-node *
-cache_insert(struct file_data *data)
-{
-	int len = strlen(data->file_name);
-	int hash_in_bucket = hash(data->file_name, len) % BUCKETS;
+/* epoll reactor implementation */
 
-	node **curr = &cache_buckets[hash_in_bucket];
+static void conn_load(struct iopool_job *job);
 
-	while (*curr) {
-		assert(!!strncmp((*curr)->data->file_name, data->file_name, len));
-		
-		curr = &((*curr)->next);
-	}
+static struct conn *
+conn_init(struct reactor *r, int connfd)
+{
+	struct conn *c = Malloc(sizeof(struct conn));
+
+	c->r = r;
+	c->fd = connfd;
+	c->rq = NULL;
+	c->data = NULL;
+	c->writing = 0;
+	c->owned = 0;
+	c->loading = 0;
+	c->job.run = conn_load;
+	c->active = now_ms();
+	head_init(&c->head);
+	arena_init(&c->arena);
+	return c;
+}
 
-	cache_usage += data->file_size;
-	*curr = make_node(data, NULL);
+/* asks epoll to report when c has more of a request to read */
+static void
+conn_watch(struct reactor *r, struct conn *c)
+{
+	struct epoll_event ev;
 
-	DEBUG_PRINT("cache insert %s", data->file_name);
-	return *curr;
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	SYS(epoll_ctl(r->epfd, EPOLL_CTL_ADD, c->fd, &ev));
 }
 
-node *cache_lookup_or_insert(struct file_data *data)
+/* hands connfd to r, which reads the requests and writes the responses
+ * without ever blocking on the connection. called by the main thread, r
+ * takes the connection over on its next time around its loop */
+static void
+reactor_add(struct reactor *r, int connfd)
 {
-	int len = strlen(data->file_name);
-	int hash_in_bucket = hash(data->file_name, len) % BUCKETS;
+	struct conn *c;
+	int flags;
 
-	node **curr = &cache_buckets[hash_in_bucket];
+	SYS(flags = fcntl(connfd, F_GETFL));
+	SYS(fcntl(connfd, F_SETFL, flags | O_NONBLOCK));
+	c = conn_init(r, connfd);
 
-	while (*curr) {
-		if (!strncmp((*curr)->data->file_name, data->file_name, len)) {
-			return *curr;
-		}
-		
-		curr = &((*curr)->next);
-	}
+	pthread_mutex_lock(&r->lock);
+	list_add_tail(&c->list, &r->added);
+	pthread_mutex_unlock(&r->lock);
 
-	/* cache_usage += data->file_size; */
-	*curr = make_node(data, NULL);
-
-	return *curr;
+	conn_watch(r, c);
 }
 
-int
-cache_delete(struct file_data *data)
+/* makes r accept connections on its own listening socket. its events carry
+ * r instead of a connection */
+static void
+reactor_listen(struct reactor *r, int listenfd)
 {
-	int deleted = 0;
-	int len = strlen(data->file_name);
-	int hash_in_bucket = hash(data->file_name, len) % BUCKETS;
+	struct epoll_event ev;
+	int flags;
+
+	SYS(flags = fcntl(listenfd, F_GETFL));
+	SYS(fcntl(listenfd, F_SETFL, flags | O_NONBLOCK));
+	r->listenfd = listenfd;
+	ev.events = EPOLLIN;
+	ev.data.ptr = r;
+	SYS(epoll_ctl(r->epfd, EPOLL_CTL_ADD, listenfd, &ev));
+}
 
-	node **head = &cache_buckets[hash_in_bucket];
-	assert(*head);
-	
-	if (!strncmp((*head)->data->file_name, data->file_name, len)) {
-		/* delete first */
+/* accepts the connections waiting on r's listening socket. r owns them from
+ * the start, no other thread is involved */
+static void
+reactor_accept(struct reactor *r)
+{
+	struct conn *c;
+	int connfd;
 
-		if ((*head)->reading) {
-#ifdef DEBUG
-			printf("%d|deleting %s, can't do it\n", pthread_t_to_small_int(pthread_self()), data->file_name);
-			//fflush(stdout);
-#endif
-			return -1;
-		}
+	while (1) {
+		connfd = accept4(r->listenfd, NULL, NULL, SOCK_NONBLOCK);
+		if (connfd < 0 && (errno == EINTR || errno == ECONNABORTED))
+			continue;
+		if (connfd < 0 && errno == EAGAIN)
+			return;
+		SYS(connfd);
+		c = conn_init(r, connfd);
+		c->owned = 1;
+		/* the newest, like in reactor_take */
+		list_add_tail(&c->list, &r->conns);
+		conn_watch(r, c);
+	}
+}
 
+/* frees the request once its response has been written */
+static void
+conn_done(struct conn *c)
+{
+	file_data_put(c->data);
+	request_destroy(c->rq);
+	arena_reset(&c->arena);
+	c->rq = NULL;
+	c->data = NULL;
 #ifdef DEBUG
-		printf("%d|deleting %s\n", pthread_t_to_small_int(pthread_self()), data->file_name);
-		//fflush(stdout);
+	cache_print();
+	fflush(stdout);
 #endif
-		cache_usage -= (*head)->data->file_size;
-		deleted = (*head)->data->file_size;
-		node *sacrificial = *head;
-		*head = (*head)->next;
-		file_data_free(sacrificial->data);
-		FREE(sacrificial);
-	} else {
-		node *prev = *head;
-		node *curr = prev->next;
-
-		while (!!strncmp(curr->data->file_name, data->file_name, len)) {
-			prev = prev->next;
-			curr = curr->next;
-
-			assert(curr);
-		}
+}
 
-		if (curr->reading) {
-			return -1;
-		}
-#ifdef DEBUG
-		printf("%d|deleting %s\n", pthread_t_to_small_int(pthread_self()), data->file_name);
-		//fflush(stdout);
-#endif
-		prev->next = curr->next;
-		cache_usage -= curr->data->file_size;
-		deleted = curr->data->file_size;
-		file_data_free(curr->data);
-		FREE(curr);
+/* closing the connection also removes it from the reactor */
+static void
+conn_close(struct conn *c)
+{
+	if (c->rq) {
+		conn_done(c);
 	}
-
-	return deleted;
+	SYS(close(c->fd));
+	list_del(&c->list);
+	arena_destroy(&c->arena);
+	free(c);
 }
 
-int cache_evict(int amount)
+/* writes as much of the response as the socket takes, and waits for it to
+ * take more if needed. returns 1 if the response has been written and the
+ * connection is ready for the next request */
+static int
+conn_write(struct reactor *r, struct conn *c)
 {
-	int deleted;
-	while (lru_list_head && amount > 0) {
-		deleted = cache_delete(lru_list_head->data);
-		if (deleted == -1) break;
+	struct epoll_event ev;
+	int ret;
 
-		assert(deleted);
-		amount -= deleted;
-		lru_node *sacrificial = lru_list_head;
-		lru_list_head = lru_list_head->next;
-		FREE(sacrificial);
+	ret = request_write(c->rq);
+	if (ret == 0) {
+		if (!c->writing) {
+			ev.events = EPOLLOUT;
+			ev.data.ptr = c;
+			SYS(epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->fd, &ev));
+			c->writing = 1;
+		}
+		return 0;
 	}
-
-	/* if successfully evicted from head, or evicted everything from head */
-	if (amount <= 0 || !lru_list_head) {
-		return amount;
+	if (ret < 0 || !request_keep_alive(c->rq)) {
+		/* the client has gone away, or the connection is done */
+		conn_close(c);
+		return 0;
 	}
-
-	lru_node *prev = lru_list_head;
-	assert(prev);
-	lru_node *curr = prev->next;
-
-	while (curr && amount > 0) {
-		assert(curr->data);
-		assert(curr->data->file_name);
-		deleted = cache_delete(curr->data);
-		assert(deleted);
-
-		if (deleted != -1) {
-			amount -= deleted;
-
-			lru_node *sacrificial = curr;
-			curr = curr->next;
-			prev->next = curr;
-
-			FREE(sacrificial);
-		} else {
-			prev = prev->next;
-			curr = curr->next;
-		}
+	conn_done(c);
+	if (c->writing) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		SYS(epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->fd, &ev));
+		c->writing = 0;
 	}
-
-	return amount;
+	return 1;
 }
 
-void cache_print()
+/* runs on an I/O thread: serves the request that conn_defer handed over, and
+ * gives c back to its reactor, which writes the response once epoll reports
+ * that the socket takes it */
+static void
+conn_load(struct iopool_job *job)
 {
-	printf("%d|cache\n%d|\t", pthread_t_to_small_int(pthread_self()),
-		   pthread_t_to_small_int(pthread_self()));
-	int i;
-	for (i = 0; i < BUCKETS; ++i) {
-		node *curr = cache_buckets[i];
-		while (curr) {
-			if (curr->data->file_name) {
-				printf("%s:%d,", curr->data->file_name, curr->reading);
-			}
-			curr = curr->next;
-		}
-	}
-	printf("\n");
+	struct conn *c = container_of(job, struct conn, job);
+	struct epoll_event ev;
+	int hit;
+
+	c->data = server_respond(c->r->sv, c->rq, c->data, &hit, NULL);
+	ev.events = EPOLLOUT;
+	ev.data.ptr = c;
+	SYS(epoll_ctl(c->r->epfd, EPOLL_CTL_ADD, c->fd, &ev));
 }
 
-/* LRU */
+/* hands the request of c, whose file missed in the cache, to the I/O threads.
+ * c leaves epoll meanwhile, so that the reactor does not touch it. the
+ * reactor must be done with c before the job is submitted */
+static void
+conn_defer(struct reactor *r, struct conn *c)
+{
+	SYS(epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, NULL));
+	c->writing = 1;
+	c->loading = 1;
+	iopool_submit(r->sv->io, &c->job);
+}
 
-lru_node *make_lru_node(struct file_data *data, lru_node *next)
+/* reads what has arrived of the next request head. once the empty line that
+ * ends it is in, the request is served like in do_server_request. pipelined
+ * requests that are already buffered are served one after the other, for as
+ * long as their responses can be written. the connection is read once at
+ * most, so that a client that keeps pipelining does not starve the others */
+static void
+conn_read(struct reactor *r, struct conn *c)
 {
-	lru_node *new_lru_node = (lru_node *) malloc(sizeof(lru_node));
-	assert(new_lru_node);
+	int n, end, missed, reads = 0;
+
+	do {
+		while (!(end = head_end(&c->head))) {
+			if (head_full(&c->head)) {
+				/* too long, a head is only a few short
+				 * lines */
+				conn_close(c);
+				return;
+			}
+			if (reads++) {
+				/* epoll reports the rest */
+				return;
+			}
+			n = read(c->fd, c->head.buf + c->head.len,
+				 sizeof(c->head.buf) - c->head.len);
+			if (n < 0 && errno == EINTR) {
+				reads = 0;
+				continue;
+			}
+			if (n < 0 && errno == EAGAIN)
+				return;
+			if (n <= 0) {
+				/* the client went away, or is done */
+				conn_close(c);
+				return;
+			}
+			c->head.len += n;
+		}
 
-	new_lru_node->data = data;
-	new_lru_node->next = next;
-	return new_lru_node;
+		c->rq = server_start(r->sv, c->fd, &c->head, end, &c->arena,
+				     &c->data, r->sv->io ? &missed : NULL);
+		if (r->sv->io && missed) {
+			conn_defer(r, c);
+			return;
+		}
+	} while (conn_write(r, c));
 }
 
-void lru_use(struct file_data *data)
+/* takes over the connections handed to r by reactor_add. they count as
+ * active since they were accepted, and are put in their place on r->conns,
+ * usually at its end */
+static void
+reactor_take(struct reactor *r)
 {
-	int len = strlen(data->file_name);
+	struct conn *c;
+	struct list_head *pos;
+
+	pthread_mutex_lock(&r->lock);
+	while (!list_empty(&r->added)) {
+		c = list_first_entry(&r->added, struct conn, list);
+		list_del(&c->list);
+		c->owned = 1;
+		pos = r->conns.prev;
+		while (pos != &r->conns &&
+		       list_entry(pos, struct conn, list)->active > c->active)
+			pos = pos->prev;
+		list_add(&c->list, pos);
+	}
+	pthread_mutex_unlock(&r->lock);
+}
 
-	if (lru_list_head) {
-		lru_node *match = NULL;
-		lru_node *prev = lru_list_head; 
-		lru_node *curr = lru_list_head->next;
+/* closes the connections that have been idle for longer than the timeout.
+ * a connection may have become ready while the reactor was busy serving
+ * others, without the reactor having been told yet. returns how long
+ * epoll_wait may wait before the next one times out, in ms */
+static int
+reactor_expire(struct reactor *r)
+{
+	struct server *sv = r->sv;
+	struct conn *c;
+	struct pollfd pfd;
+	long now, timeout;
 
-		if (!strncmp(prev->data->file_name, data->file_name, len)) {
-			match = prev;
+	reactor_take(r);
+	now = now_ms();
 
-			lru_list_head = curr;
+	if (!sv->idle_timeout) {
+		/* connections are closed after one response anyway */
+		return -1;
+	}
+	timeout = sv->idle_timeout * 1000;
+	while (!list_empty(&r->conns)) {
+		c = list_first_entry(&r->conns, struct conn, list);
+		if (c->active + timeout > now)
+			return c->active + timeout - now;
+		pfd.fd = c->fd;
+		pfd.events = c->writing ? POLLOUT : POLLIN;
+		if (c->loading || poll(&pfd, 1, 0) > 0) {
+			/* busy on an I/O thread, or epoll reports it next */
+			list_del(&c->list);
+			c->active = now;
+			list_add_tail(&c->list, &r->conns);
+			continue;
 		}
+		conn_close(c);
+	}
+	/* wakes up to take over new connections that stay silent */
+	return timeout;
+}
 
-		while (curr) {
-			assert(curr->data);
-			assert(curr->data->file_name);
-			if (!strncmp(curr->data->file_name, data->file_name, len)) {
-				assert(!match);
-				match = curr;
-
-				prev->next = curr->next;
-			} else {
-				prev = prev->next;
-			}
-			curr = curr->next;
-		}
+void *reactor(void *r_v)
+{
+	struct reactor *r = (struct reactor *) r_v;
+	struct epoll_event events[REACTOR_EVENTS];
+	int i, n;
+	long now;
 
-		if (match) {
-			if (lru_list_head) {
-				prev->next = match;
-			} else {
-				lru_list_head = match;
+	while (1) {
+		n = epoll_wait(r->epfd, events, REACTOR_EVENTS,
+			       reactor_expire(r));
+		if (n < 0 && errno == EINTR)
+			continue;
+		SYS(n);
+		now = now_ms();
+		for (i = 0; i < n; i++) {
+			struct conn *c = events[i].data.ptr;
+
+			if (events[i].data.ptr == r) {
+				reactor_accept(r);
+				continue;
 			}
-			match->next = NULL;
-		} else {
-			prev->next = make_lru_node(data, NULL);
+			/* reactor_add puts c on the added list before epoll
+			 * can report it */
+			if (!c->owned)
+				reactor_take(r);
+			list_del(&c->list);
+			c->active = now;
+			list_add_tail(&c->list, &r->conns);
+			/* back from the I/O threads, its response is staged */
+			c->loading = 0;
+			if (!c->rq || conn_write(r, c))
+				conn_read(r, c);
 		}
-	} else {
-		lru_list_head = make_lru_node(data, NULL);
 	}
+	return NULL;
 }
 
-void lru_print()
+/* io_uring worker implementation */
+
+/* frees the request once its response has been written */
+static void
+uconn_done(struct uconn *c)
 {
-	printf("%d|lru\n%d|\t", pthread_t_to_small_int(pthread_self()),
-		   pthread_t_to_small_int(pthread_self()));
-	lru_node *n = lru_list_head;
-	while (n) {
-		printf("%s,", n->data->file_name);
-		n = n->next;
-	}
-	printf("\n");
+	file_data_put(c->data);
+	request_destroy(c->rq);
+	arena_reset(&c->arena);
+	c->rq = NULL;
+	c->data = NULL;
+#ifdef DEBUG
+	cache_print();
+	fflush(stdout);
+#endif
 }
 
-/* circular Q implementation */
-
-void q_init(circular_q *q, unsigned max_size)
+static void
+uconn_close(struct uconn *c)
 {
-	q->max_q_size_plus_one = max_size + 1;
-	q->q = malloc(sizeof(int) * q->max_q_size_plus_one);
-	q->start = q->end = 0;
+	if (c->rq) {
+		uconn_done(c);
+	}
+	SYS(close(c->fd));
+	arena_destroy(&c->arena);
+	free(c);
 }
 
-int q_full(const circular_q *q)
+/* queues a recv for more of the request head. with an idle timeout, the recv
+ * is linked to a timeout that cancels it. the completion of the timeout
+ * itself carries no connection and is ignored */
+static void
+uconn_recv(struct uworker *w, struct uconn *c)
 {
-	return q->start == ((q->end + 1) % q->max_q_size_plus_one);
+	struct io_uring_sqe *sqe;
+
+	/* the two entries must go to the kernel together */
+	if (uring_sq_space(&w->ring) < 2) {
+		SYS(uring_submit_and_wait(&w->ring, 0));
+	}
+	sqe = uring_get_sqe(&w->ring);
+	uring_prep_recv(sqe, c->fd, c->head.buf + c->head.len,
+			sizeof(c->head.buf) - c->head.len, c);
+	if (w->sv->idle_timeout) {
+		sqe->flags |= IOSQE_IO_LINK;
+		uring_prep_link_timeout(uring_get_sqe(&w->ring), &w->idle,
+					NULL);
+	}
 }
 
-int q_empty(const circular_q *q)
+/* queues a send of the staged buffers. the file part of a response sent from
+ * disk goes out with sendfile once they are written, without blocking: the
+ * socket is made non-blocking, which no queued operation minds meanwhile, and
+ * polled for when it takes more. returns 1 if the response has been written
+ * and the connection is ready for the next request */
+static int
+uconn_send(struct uworker *w, struct uconn *c)
 {
-	return q->start == q->end;
+	struct iovec *iov;
+	int n, flags, ret;
+
+	n = request_iov(c->rq, &iov);
+	if (n > 0) {
+		memset(&c->msg, 0, sizeof(c->msg));
+		c->msg.msg_iov = iov;
+		c->msg.msg_iovlen = n;
+		uring_prep_sendmsg(uring_get_sqe(&w->ring), c->fd, &c->msg,
+				   MSG_NOSIGNAL, c);
+		return 0;
+	}
+	if (!c->polling && request_pending(c->rq)) {
+		SYS(flags = fcntl(c->fd, F_GETFL));
+		SYS(fcntl(c->fd, F_SETFL, flags | O_NONBLOCK));
+		c->polling = 1;
+	}
+	ret = request_write(c->rq);
+	if (ret == 0) {
+		uring_prep_poll_add(uring_get_sqe(&w->ring), c->fd, POLLOUT,
+				    c);
+		return 0;
+	}
+	if (ret < 0 || !request_keep_alive(c->rq)) {
+		/* the client has gone away, or the connection is done */
+		uconn_close(c);
+		return 0;
+	}
+	uconn_done(c);
+	if (c->polling) {
+		/* the next recv is queued */
+		SYS(flags = fcntl(c->fd, F_GETFL));
+		SYS(fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK));
+		c->polling = 0;
+	}
+	return 1;
 }
 
-int q_size(const circular_q *q)
+/* runs on an I/O thread: serves the request that uconn_serve handed over,
+ * and gives c back to its uworker through loadfd */
+static void
+uconn_load(struct iopool_job *job)
 {
-	unsigned size = q->end - q->start;
-	return size < 0 ? size + q->max_q_size_plus_one : size; 
+	struct uconn *c = container_of(job, struct uconn, job);
+	struct uworker *w = c->w;
+	int hit;
+
+	c->data = server_respond(w->sv, c->rq, c->data, &hit, NULL);
+	pthread_mutex_lock(&w->lock);
+	list_add_tail(&c->list, &w->loaded);
+	pthread_mutex_unlock(&w->lock);
+	SYS(eventfd_write(w->loadfd, 1));
 }
 
-void q_print(const circular_q *q)
+/* serves the request heads that have been read, like in do_server_request,
+ * for as long as their responses can be written right away. pipelined
+ * requests are buffered behind the first one. queues a recv once more of a
+ * head is needed. a request whose file missed in the cache goes to the I/O
+ * threads, and no operation is queued for c until it is back */
+static void
+uconn_serve(struct uworker *w, struct uconn *c)
 {
-	unsigned i = q->start;
-	while (i != q->end) {
-		printf("%d|%d ", pthread_t_to_small_int(pthread_self()), q->q[i]);
-		i = (i + 1) % q->max_q_size_plus_one;
-	}
-	printf("\n");
+	int end, missed;
+
+	do {
+		end = head_end(&c->head);
+		if (!end) {
+			if (head_full(&c->head)) {
+				/* too long, a head is only a few short
+				 * lines */
+				uconn_close(c);
+			} else {
+				uconn_recv(w, c);
+			}
+			return;
+		}
+		c->rq = server_start(w->sv, c->fd, &c->head, end, &c->arena,
+				     &c->data, w->sv->io ? &missed : NULL);
+		if (w->sv->io && missed) {
+			iopool_submit(w->sv->io, &c->job);
+			return;
+		}
+	} while (uconn_send(w, c));
 }
 
-void q_enq(circular_q *q, int a)
+static void
+uworker_accept(struct uworker *w)
 {
-	assert( !q_full(q) );
-
-	q->q[q->end] = a;
-	q->end = (q->end + 1) % q->max_q_size_plus_one;
+	uring_prep_accept(uring_get_sqe(&w->ring), w->listenfd, w);
 }
 
-int q_deq(circular_q *q)
+static void
+uworker_poll_loaded(struct uworker *w)
 {
-	assert( !q_empty(q) );
-
-	int ret = q->q[q->start];
-	q->start = (q->start + 1) % q->max_q_size_plus_one;
-	return ret;
+	uring_prep_poll_add(uring_get_sqe(&w->ring), w->loadfd, POLLIN,
+			    &w->loadfd);
 }
 
-/* */
+/* sends the responses that the I/O threads have staged */
+static void
+uworker_loaded(struct uworker *w)
+{
+	struct list_head loaded;
+	struct uconn *c;
+	eventfd_t v;
+
+	/* fails with EAGAIN if another wakeup already drained it */
+	eventfd_read(w->loadfd, &v);
+	INIT_LIST_HEAD(&loaded);
+	pthread_mutex_lock(&w->lock);
+	list_splice_tail(&w->loaded, &loaded);
+	INIT_LIST_HEAD(&w->loaded);
+	pthread_mutex_unlock(&w->lock);
+	while (!list_empty(&loaded)) {
+		c = list_first_entry(&loaded, struct uconn, list);
+		list_del(&c->list);
+		if (uconn_send(w, c))
+			uconn_serve(w, c);
+	}
+}
 
-int pthread_t_to_small_int(pthread_t pt)
+/* each worker keeps an accept queued on the listening socket and a recv, send
+ * or poll for each of its connections. all the operations queued while
+ * handling a batch of completions go to the kernel in the same system call
+ * that waits for the next batch */
+void *uworker(void *w_v)
 {
-	int i = 0;
-	while (threads[i++] != pt);
-	return i;
+	struct uworker *w = (struct uworker *) w_v;
+	struct io_uring_cqe *cqe;
+	struct uconn *c;
+	void *ud;
+	int res;
+
+	uworker_accept(w);
+	if (w->sv->io)
+		uworker_poll_loaded(w);
+	while (1) {
+		SYS(uring_submit_and_wait(&w->ring, 1));
+		while ((cqe = uring_peek_cqe(&w->ring))) {
+			ud = (void *)(unsigned long)cqe->user_data;
+			res = cqe->res;
+			uring_cqe_seen(&w->ring);
+
+			if (!ud) {
+				/* a recv timeout */
+				continue;
+			}
+			if (ud == &w->loadfd) {
+				uworker_loaded(w);
+				uworker_poll_loaded(w);
+				continue;
+			}
+			if (ud == w) {
+				if (res >= 0) {
+					c = Malloc(sizeof(struct uconn));
+					c->w = w;
+					c->fd = res;
+					c->rq = NULL;
+					c->data = NULL;
+					c->polling = 0;
+					c->job.run = uconn_load;
+					head_init(&c->head);
+					arena_init(&c->arena);
+					uconn_recv(w, c);
+				}
+				uworker_accept(w);
+				continue;
+			}
+			c = ud;
+			if (!c->rq) {
+				/* a recv, which fails once it times out */
+				if (res <= 0) {
+					uconn_close(c);
+					continue;
+				}
+				c->head.len += res;
+				uconn_serve(w, c);
+			} else if (!c->polling && res <= 0) {
+				/* the client has gone away */
+				uconn_close(c);
+			} else {
+				if (!c->polling)
+					request_wrote(c->rq, res);
+				if (uconn_send(w, c))
+					uconn_serve(w, c);
+			}
+		}
+	}
+	return NULL;
 }
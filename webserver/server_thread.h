@@ -1,10 +1,77 @@
 #ifndef __SERVER_THREAD_H__
 #define __SERVER_THREAD_H__
 
+#include <stdio.h>
+
 struct server;
+struct cache_policy;
+
+/* how connections are served
+ *
+ * SERVER_THREADS: the main thread accepts connections and queues them for
+ *                 nr_threads worker threads, each of which reads a request
+ *                 and writes its response before taking the next one. each
+ *                 worker has its own queue, and steals from the others'
+ *                 once it is empty
+ * SERVER_EPOLL:   connections are spread over nr_threads epoll event loops,
+ *                 which read requests and write responses without blocking,
+ *                 so slow clients do not tie up threads
+ * SERVER_URING:   like SERVER_EPOLL, but each of nr_threads workers accepts,
+ *                 reads and writes through its own io_uring, batching the
+ *                 operations of all its connections into one system call
+ *
+ * with nr_io_threads, the epoll and io_uring workers hand a request whose file
+ * misses in the cache to a separate pool of I/O threads, which read it and
+ * stage the response. the worker writes it once it is staged, and serves the
+ * other connections meanwhile. a worker thread of SERVER_THREADS is tied to
+ * its connection anyway, and always reads the file itself */
+enum { SERVER_THREADS, SERVER_EPOLL, SERVER_URING };
+
+extern const char *server_modes[];	/* names, indexed by SERVER_* */
+int server_mode_find(const char *name);
+
+/* server configuration, filled in from the command line by server.c */
+struct server_config {
+	int mode;		/* SERVER_* */
+	int nr_threads;
+	int max_requests;
+	int max_cache_size;
+	int nr_shards;
+	const struct cache_policy *policy;
+	int admission;		/* ADMIT_*, see cache.h */
+	int admit_threshold;	/* in bytes */
+	int zero_copy_size;	/* files this big are never read into memory,
+				 * 0 for no limit */
+	int backend;		/* CACHE_*, see cache.h */
+	int idle_timeout;	/* seconds a persistent connection may stay
+				 * idle, 0 to close connections after one
+				 * response */
+	int reuseport;		/* each worker accepts its own connections on
+				 * its own listening socket */
+	int pin;		/* pin each worker thread to a cpu */
+	int nr_io_threads;	/* read the files that miss in the cache, 0 to
+				 * have the worker threads read them */
+	unsigned long spill_size;	/* bytes of the warm tier of the cache
+					 * on disk, 0 for none */
+	int revalidate;		/* seconds a cached file is trusted before a
+				 * hit checks it on disk, 0 to check on every
+				 * hit */
+	/* warming the cache up at startup, each may be NULL. the hot list and
+	 * the snapshot are read if they are there, and written by
+	 * server_save */
+	const char *warm_list;	/* files to read in the background */
+	const char *hot_list;	/* the names of the cached files */
+	const char *snapshot;	/* the cached files, see snapshot.h */
+};
 
-struct server *server_init(int nr_threads, int max_requests, 
-			   int max_cache_size);
+struct server *server_init(const struct server_config *cfg);
 void server_request(struct server *sv, int connfd);
+/* in SERVER_URING mode, or with reuseport set, the workers accept the
+ * connections themselves, on the listening sockets that server_listen opens.
+ * otherwise the caller accepts them and hands them to server_request */
+void server_listen(struct server *sv, int port);
+void server_stats(struct server *sv, FILE *out);
+/* saves the hot list and the snapshot, if configured, at shutdown */
+void server_save(struct server *sv, FILE *out);
 
 #endif /* __SERVER_THREAD_H__ */
@@ -0,0 +1,91 @@
+#include "common.h"
+#include "sketch.h"
+
+#define SKETCH_ROWS 4
+#define SKETCH_MAX 15
+/* counters are halved after this many increments per counter in a row */
+#define SKETCH_SAMPLE_FACTOR 10
+
+struct sketch {
+	unsigned char *table;	/* SKETCH_ROWS rows of width counters */
+	unsigned width;		/* a power of two */
+	unsigned additions;
+	unsigned sample_size;
+};
+
+static const unsigned long seeds[SKETCH_ROWS] = {
+	0x9e3779b97f4a7c15UL, 0xc2b2ae3d27d4eb4fUL,
+	0x165667b19e3779f9UL, 0xd6e8feb86659fd93UL,
+};
+
+/* nr_entries is roughly the number of distinct files the sketch should
+ * tell apart */
+struct sketch *
+sketch_init(unsigned nr_entries)
+{
+	struct sketch *s = Malloc(sizeof(struct sketch));
+
+	s->width = 64;
+	while (s->width < nr_entries)
+		s->width *= 2;
+	s->table = calloc(SKETCH_ROWS * s->width, 1);
+	assert(s->table);
+	s->additions = 0;
+	s->sample_size = SKETCH_SAMPLE_FACTOR * s->width;
+	return s;
+}
+
+void
+sketch_destroy(struct sketch *s)
+{
+	free(s->table);
+	free(s);
+}
+
+static unsigned
+sketch_index(const struct sketch *s, unsigned long hash, int row)
+{
+	unsigned long h = (hash ^ (hash >> 29)) * seeds[row];
+	return row * s->width + ((h >> 32) & (s->width - 1));
+}
+
+static void
+sketch_reset(struct sketch *s)
+{
+	unsigned i;
+
+	for (i = 0; i < SKETCH_ROWS * s->width; i++)
+		s->table[i] >>= 1;
+	s->additions /= 2;
+}
+
+void
+sketch_increment(struct sketch *s, unsigned long hash)
+{
+	int row;
+	int added = 0;
+
+	for (row = 0; row < SKETCH_ROWS; row++) {
+		unsigned char *c = &s->table[sketch_index(s, hash, row)];
+		if (*c < SKETCH_MAX) {
+			(*c)++;
+			added = 1;
+		}
+	}
+	if (added && ++s->additions >= s->sample_size)
+		sketch_reset(s);
+}
+
+int
+sketch_estimate(const struct sketch *s, unsigned long hash)
+{
+	int row;
+	int min = SKETCH_MAX;
+
+	for (row = 0; row < SKETCH_ROWS; row++) {
+		int c = s->table[sketch_index(s, hash, row)];
+		if (c < min)
+			min = c;
+	}
+	return min;
+}
@@ -0,0 +1,14 @@
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+/* count-min sketch estimating how often a file was requested recently (the
+ * TinyLFU frequency sketch). counters saturate at 15 and are all halved once
+ * enough increments have been made, so old popularity fades away. */
+struct sketch;
+
+struct sketch *sketch_init(unsigned nr_entries);
+void sketch_destroy(struct sketch *s);
+void sketch_increment(struct sketch *s, unsigned long hash);
+int  sketch_estimate(const struct sketch *s, unsigned long hash);
+
+#endif /* __SKETCH_H__ */
@@ -0,0 +1,114 @@
+#include "common.h"
+#include "slab.h"
+
+#define SLAB_MAX 8		/* slabs in all */
+#define SLAB_BATCH 32		/* objects moved at once to or from the
+				 * shared list */
+
+/* a free object, which holds the links of the free lists */
+struct slab_obj {
+	struct slab_obj *next;		/* in the same batch */
+	struct slab_obj *next_batch;	/* on the shared list, in the first
+					 * object of a batch */
+};
+
+/* the list of free objects of a slab kept by a thread */
+struct slab_list {
+	struct slab_obj *free;
+	int nr;
+};
+
+static __thread struct slab_list slab_lists[SLAB_MAX];
+static int nr_slabs;
+
+/* size is rounded up to keep the objects aligned. call before any thread
+ * uses the slab */
+void
+slab_init(struct slab *s, size_t size)
+{
+	if (size < sizeof(struct slab_obj))
+		size = sizeof(struct slab_obj);
+	s->size = (size + 15) & ~(size_t)15;
+	s->id = __atomic_fetch_add(&nr_slabs, 1, __ATOMIC_RELAXED);
+	assert(s->id < SLAB_MAX);
+	pthread_mutex_init(&s->lock, NULL);
+	s->free = NULL;
+}
+
+/* moves a batch from the shared list to l, carving a new one out of the heap
+ * if the shared list is empty */
+static void
+slab_refill(struct slab *s, struct slab_list *l)
+{
+	struct slab_obj *batch;
+	char *mem;
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	batch = s->free;
+	if (batch)
+		s->free = batch->next_batch;
+	pthread_mutex_unlock(&s->lock);
+
+	if (!batch) {
+		mem = Malloc(s->size * SLAB_BATCH);
+		for (i = 0; i < SLAB_BATCH; i++) {
+			struct slab_obj *obj = (struct slab_obj *)
+				(mem + i * s->size);
+
+			obj->next = i + 1 < SLAB_BATCH ?
+				(struct slab_obj *)(mem + (i + 1) * s->size) :
+				NULL;
+		}
+		batch = (struct slab_obj *)mem;
+	}
+	l->free = batch;
+	l->nr = SLAB_BATCH;
+}
+
+void *
+slab_alloc(struct slab *s)
+{
+	struct slab_list *l = &slab_lists[s->id];
+	struct slab_obj *obj;
+
+	if (!l->free)
+		slab_refill(s, l);
+	obj = l->free;
+	l->free = obj->next;
+	l->nr--;
+	return obj;
+}
+
+void
+slab_free(struct slab *s, void *obj_v)
+{
+	struct slab_list *l = &slab_lists[s->id];
+	struct slab_obj *obj = obj_v, *batch;
+	int i;
+
+	if (!obj)
+		return;
+#ifdef DEBUG
+	memset(obj, 0, s->size);
+#endif
+	obj->next = l->free;
+	l->free = obj;
+	l->nr++;
+	if (l->nr < 2 * SLAB_BATCH)
+		return;
+
+	/* give the first batch of the list back */
+	batch = l->free;
+	obj = batch;
+	for (i = 1; i < SLAB_BATCH; i++)
+		obj = obj->next;
+	l->free = obj->next;
+	l->nr -= SLAB_BATCH;
+	obj->next = NULL;
+
+	pthread_mutex_lock(&s->lock);
+	batch->next_batch = s->free;
+	s->free = batch;
+	pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,26 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* a pool of objects of one size, for objects that are allocated and freed
+ * all the time, like cache nodes. each thread keeps a list of free objects
+ * of its own, so that slab_alloc and slab_free usually take no lock and make
+ * no heap call. a thread whose list runs dry takes a batch of objects from a
+ * list shared by all threads, which is refilled with one Malloc call per
+ * batch, and a thread whose list grows too long gives a batch back to it.
+ * objects may be freed by another thread than the one that allocated them.
+ * memory is never given back to the heap. */
+struct slab {
+	size_t size;
+	int id;			/* of the lists of this slab, see slab.c */
+	pthread_mutex_t lock;
+	void *free;		/* the shared list, of batches */
+};
+
+void slab_init(struct slab *s, size_t size);
+void *slab_alloc(struct slab *s);
+void slab_free(struct slab *s, void *obj);
+
+#endif /* __SLAB_H__ */
@@ -0,0 +1,218 @@
+#include "request.h"
+#include "common.h"
+#include "cache.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "OSWSNAP1"
+
+struct snapshot_head {
+	char magic[8];		/* SNAPSHOT_MAGIC */
+	unsigned nr;		/* entries in the index */
+	unsigned index_len;	/* bytes of the index, after the head */
+};
+
+/* followed by the file name and its NUL, padded to 8 bytes so that the next
+ * entry is aligned */
+struct snapshot_entry {
+	unsigned long off;	/* of the contents, a multiple of the page size */
+	time_t mtime;		/* of the file when it was read */
+	unsigned size;
+	unsigned name_len;	/* without the NUL */
+};
+
+/* the cached files being saved, one reference each */
+struct snapshot_files {
+	struct file_data **data;
+	int nr, max;
+};
+
+static unsigned long
+snapshot_align(unsigned long n, unsigned long to)
+{
+	return (n + to - 1) / to * to;
+}
+
+static unsigned
+snapshot_entry_len(unsigned name_len)
+{
+	return sizeof(struct snapshot_entry) + snapshot_align(name_len + 1, 8);
+}
+
+/* empty files take no time to read, and have nothing to map */
+static void
+snapshot_collect(struct file_data *data, void *files_v)
+{
+	struct snapshot_files *files = (struct snapshot_files *)files_v;
+
+	if (!data->file_size || !data->file_buf)
+		return;
+	if (files->nr == files->max) {
+		files->max = files->max ? files->max * 2 : 64;
+		files->data = realloc(files->data,
+				      files->max * sizeof(struct file_data *));
+		assert(files->data);
+	}
+	files->data[files->nr++] = file_data_get(data);
+}
+
+static void
+snapshot_write(int fd, const char *buf, unsigned long len, unsigned long off)
+{
+	unsigned long done;
+	ssize_t n;
+
+	for (done = 0; done < len; done += n) {
+		n = pwrite(fd, buf + done, len - done, off + done);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n < 0 && errno == EFAULT) {
+			/* a mapped file was truncated on disk, the rest
+			 * of it is left a hole. snapshot_restore_entry
+			 * drops it, as its size has changed */
+			return;
+		}
+		SYS(n);
+	}
+}
+
+int
+snapshot_save(const char *path)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	struct snapshot_files files = { NULL, 0, 0 };
+	struct snapshot_head *head;
+	struct snapshot_entry *e;
+	unsigned long index_len, off;
+	char *index, *tmp;
+	int fd, i, len;
+
+	cache_foreach(snapshot_collect, &files);
+
+	index_len = 0;
+	for (i = 0; i < files.nr; i++) {
+		index_len += snapshot_entry_len(strlen(files.data[i]->file_name));
+	}
+	index = Malloc(sizeof(struct snapshot_head) + index_len);
+	memset(index, 0, sizeof(struct snapshot_head) + index_len);
+	head = (struct snapshot_head *)index;
+	memcpy(head->magic, SNAPSHOT_MAGIC, sizeof(head->magic));
+	head->nr = files.nr;
+	head->index_len = index_len;
+
+	len = strlen(path) + sizeof(".tmp");
+	tmp = Malloc(len);
+	snprintf(tmp, len, "%s.tmp", path);
+	SYS(fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+
+	/* the contents follow the index, each on a page of its own */
+	e = (struct snapshot_entry *)(head + 1);
+	off = snapshot_align(sizeof(struct snapshot_head) + index_len,
+			     page_size);
+	for (i = 0; i < files.nr; i++) {
+		struct file_data *data = files.data[i];
+
+		e->off = off;
+		e->mtime = data->file_mtime;
+		e->size = data->file_size;
+		e->name_len = strlen(data->file_name);
+		memcpy(e + 1, data->file_name, e->name_len);
+		snapshot_write(fd, data->file_buf, data->file_size, off);
+		off = snapshot_align(off + data->file_size, page_size);
+		e = (struct snapshot_entry *)((char *)e +
+					      snapshot_entry_len(e->name_len));
+		file_data_put(data);
+	}
+	snapshot_write(fd, index, sizeof(struct snapshot_head) + index_len, 0);
+	SYS(close(fd));
+	SYS(rename(tmp, path));
+
+	free(tmp);
+	free(index);
+	free(files.data);
+	return files.nr;
+}
+
+/* maps the contents of the file of e, if it has not changed since, and
+ * inserts them into the cache. returns whether it did */
+static int
+snapshot_restore_entry(int fd, const struct snapshot_entry *e)
+{
+	const char *name = (const char *)(e + 1);
+	struct file_data *data;
+	struct stat sbuf;
+	int restored;
+
+	if (stat(name, &sbuf) < 0 || !S_ISREG(sbuf.st_mode) ||
+	    sbuf.st_mtime != e->mtime || sbuf.st_size != e->size)
+		return 0;
+
+	data = file_data_init();
+	data->file_name = Malloc(e->name_len + 1);
+	memcpy(data->file_name, name, e->name_len + 1);
+	data->file_size = e->size;
+	data->file_mtime = e->mtime;
+	data->file_buf = mmap(NULL, e->size, PROT_READ, MAP_PRIVATE, fd,
+			      e->off);
+	if (data->file_buf == MAP_FAILED) {
+		unix_error("mmap error");
+	}
+	data->mapped = 1;
+	request_make_header(data, data->file_buf);
+	restored = cache_restore(data);
+	file_data_put(data);
+	return restored;
+}
+
+int
+snapshot_restore(const char *path)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	const struct snapshot_head *head;
+	const struct snapshot_entry *e;
+	const char *map, *p, *end;
+	struct stat sbuf;
+	int fd, restored = 0;
+	unsigned i;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	SYS(fstat(fd, &sbuf));
+	if (sbuf.st_size < (off_t)sizeof(struct snapshot_head)) {
+		SYS(close(fd));
+		return 0;
+	}
+	map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		unix_error("mmap error");
+	}
+	head = (const struct snapshot_head *)map;
+	if (memcmp(head->magic, SNAPSHOT_MAGIC, sizeof(head->magic)) ||
+	    head->index_len > sbuf.st_size - sizeof(struct snapshot_head)) {
+		fprintf(stderr, "%s is not a snapshot\n", path);
+		goto out;
+	}
+
+	/* an entry that does not fit ends the index */
+	p = (const char *)(head + 1);
+	end = p + head->index_len;
+	for (i = 0; i < head->nr; i++) {
+		e = (const struct snapshot_entry *)p;
+		if (p + sizeof(struct snapshot_entry) > end ||
+		    e->name_len > (unsigned long)(end - p) ||
+		    p + snapshot_entry_len(e->name_len) > end ||
+		    p[sizeof(struct snapshot_entry) + e->name_len] != '\0' ||
+		    !e->size || e->off % page_size ||
+		    e->off + e->size > (unsigned long)sbuf.st_size)
+			break;
+		restored += snapshot_restore_entry(fd, e);
+		p += snapshot_entry_len(e->name_len);
+	}
+out:
+	/* the contents have mappings of their own */
+	SYS(munmap((void *)map, sbuf.st_size));
+	SYS(close(fd));
+	return restored;
+}
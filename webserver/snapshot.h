@@ -0,0 +1,21 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+/* a snapshot of the cache, saved at shutdown and restored at startup, so
+ * that a restarted server does not read every hot file from the slow disk
+ * again.
+ *
+ * the snapshot file starts with an index of the cached files, their sizes and
+ * modification times, followed by their contents, each starting on a page.
+ * restoring maps each file's contents straight from the snapshot, so the
+ * cache holds them like the mmap backend does, and nothing is copied. files
+ * that have changed on disk since the snapshot was saved are left out.
+ *
+ * snapshot_save writes a new file and renames it over path, so the mappings
+ * of the old one stay valid. both return the number of files saved or
+ * restored, snapshot_restore 0 if there is no snapshot at path, or it is not
+ * one */
+int snapshot_save(const char *path);
+int snapshot_restore(const char *path);
+
+#endif /* __SNAPSHOT_H__ */
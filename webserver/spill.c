@@ -0,0 +1,384 @@
+#include <zlib.h>
+#include "request.h"
+#include "common.h"
+#include "cache.h"
+#include "spill.h"
+
+#define SPILL_BUCKETS 4096
+/* files queued for the writer, beyond which spill_put drops them */
+#define SPILL_PENDING_MAX 64
+
+/* a file in the log */
+struct spill_entry {
+	char *name;
+	unsigned long hash;
+	unsigned long off;	/* in the spill file */
+	unsigned len;		/* bytes in the log */
+	unsigned size;		/* bytes once read back */
+	time_t mtime;		/* of the file when it was read */
+	int compressed;		/* len bytes of deflate, or the file as it is */
+	int written;		/* the bytes are in the log, see spill_append */
+	unsigned long gen;	/* tells the entry from a later one in its
+				 * place, see spill_get */
+	struct spill_entry *next;	/* in its bucket */
+	struct list_head log;	/* on the spill's entries */
+};
+
+/* a file queued for the writer, which holds a reference to it */
+struct spill_pending {
+	struct file_data *data;
+	struct list_head list;
+};
+
+struct spill {
+	int fd;
+	unsigned long size;
+	unsigned long head;		/* where the next file is written */
+	unsigned long gen;		/* of the last entry */
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;	/* signalled when a file is queued */
+	struct spill_entry *buckets[SPILL_BUCKETS];
+	struct list_head entries;	/* in log order, the oldest first */
+	struct list_head pending;	/* for the writer */
+	int nr_pending;
+	unsigned long nr_entries, stored, original;	/* in the log now */
+	unsigned long written, overwritten, overrun;
+	unsigned long lookups, hits, stale;
+};
+
+static struct spill_entry *
+spill_find(struct spill *s, const char *name, unsigned long h)
+{
+	struct spill_entry *e;
+
+	for (e = s->buckets[h % SPILL_BUCKETS]; e; e = e->next) {
+		if (e->hash == h && !strcmp(e->name, name))
+			return e;
+	}
+	return NULL;
+}
+
+/* e is being written over, or the file has changed since */
+static void
+spill_drop(struct spill *s, struct spill_entry *e)
+{
+	struct spill_entry **curr = &s->buckets[e->hash % SPILL_BUCKETS];
+
+	while (*curr != e) {
+		assert(*curr);
+		curr = &((*curr)->next);
+	}
+	*curr = e->next;
+	list_del(&e->log);
+	s->nr_entries--;
+	s->stored -= e->len;
+	s->original -= e->size;
+	free(e->name);
+	free(e);
+}
+
+/* reserves len bytes where the log ends for data, over the oldest files, and
+ * returns the entry, which is not written yet. called with s->lock held */
+static struct spill_entry *
+spill_reserve(struct spill *s, struct file_data *data, unsigned len,
+	      int compressed, unsigned long h)
+{
+	struct spill_entry *e;
+
+	if (s->head + len > s->size) {
+		/* wrap around. the files left after head, from the last time
+		 * around, are the oldest */
+		while (!list_empty(&s->entries) &&
+		       list_first_entry(&s->entries, struct spill_entry,
+					log)->off >= s->head) {
+			spill_drop(s, list_first_entry(&s->entries,
+						       struct spill_entry, log));
+			s->overwritten++;
+		}
+		s->head = 0;
+	}
+	/* the files from the last time around all start at head or after */
+	while (!list_empty(&s->entries)) {
+		e = list_first_entry(&s->entries, struct spill_entry, log);
+		if (e->off < s->head || e->off >= s->head + len)
+			break;
+		spill_drop(s, e);
+		s->overwritten++;
+	}
+
+	e = Malloc(sizeof(struct spill_entry));
+	e->name = Malloc(strlen(data->file_name) + 1);
+	strcpy(e->name, data->file_name);
+	e->hash = h;
+	e->off = s->head;
+	e->len = len;
+	e->size = data->file_size;
+	e->mtime = data->file_mtime;
+	e->compressed = compressed;
+	e->written = 0;
+	e->gen = ++s->gen;
+	e->next = s->buckets[h % SPILL_BUCKETS];
+	s->buckets[h % SPILL_BUCKETS] = e;
+	list_add_tail(&e->log, &s->entries);
+
+	s->head += len;
+	s->nr_entries++;
+	s->stored += len;
+	s->original += e->size;
+	return e;
+}
+
+/* appends len bytes of buf, which hold data, to the log, unless data is in it
+ * already. the place is reserved with s->lock held and written without it,
+ * so lookups and readers of other files do not wait for the disk. readers
+ * skip the entry until it is written */
+static void
+spill_append(struct spill *s, struct file_data *data, const char *buf,
+	     unsigned len, int compressed, unsigned long h)
+{
+	struct spill_entry *e;
+	unsigned long done, off, gen;
+	ssize_t n;
+
+	pthread_mutex_lock(&s->lock);
+	if (spill_find(s, data->file_name, h)) {
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	e = spill_reserve(s, data, len, compressed, h);
+	off = e->off;
+	gen = e->gen;
+	pthread_mutex_unlock(&s->lock);
+
+	for (done = 0; done < len; done += n) {
+		n = pwrite(s->fd, buf + done, len - done, off + done);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		SYS(n);
+	}
+
+	/* a lookup may have dropped the entry meanwhile, if the file changed
+	 * on disk */
+	pthread_mutex_lock(&s->lock);
+	e = spill_find(s, data->file_name, h);
+	if (e && e->gen == gen) {
+		e->written = 1;
+		s->written++;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+struct spill_compress {
+	struct file_data *data;
+	char *buf;		/* compressBound bytes */
+	uLongf len;		/* of buf, then of what was put in it */
+	int compressed;
+};
+
+/* compresses the file into c->buf, or copies it there as it is if it does
+ * not shrink, so that a mapped file is only read here, see spill_writer */
+static void
+spill_compress(void *c_v)
+{
+	struct spill_compress *c = (struct spill_compress *)c_v;
+	struct file_data *data = c->data;
+
+	c->compressed = compress2((Bytef *)c->buf, &c->len,
+				  (const Bytef *)data->file_buf,
+				  data->file_size, Z_BEST_SPEED) == Z_OK &&
+		c->len < (uLongf)data->file_size;
+	if (!c->compressed) {
+		memcpy(c->buf, data->file_buf, data->file_size);
+		c->len = data->file_size;
+	}
+}
+
+/* compresses the queued files and appends them to the log */
+static void *
+spill_writer(void *s_v)
+{
+	struct spill *s = (struct spill *)s_v;
+	struct spill_pending *p;
+	struct spill_compress c;
+	struct file_data *data;
+	unsigned long h;
+	int kept;
+
+	while (1) {
+		pthread_mutex_lock(&s->lock);
+		while (list_empty(&s->pending)) {
+			pthread_cond_wait(&s->not_empty, &s->lock);
+		}
+		p = list_first_entry(&s->pending, struct spill_pending, list);
+		list_del(&p->list);
+		s->nr_pending--;
+		pthread_mutex_unlock(&s->lock);
+
+		data = p->data;
+		free(p);
+		h = hash(data->file_name, strlen(data->file_name));
+		/* files that do not shrink are stored as they are */
+		c.data = data;
+		c.len = compressBound(data->file_size);
+		c.buf = Malloc(c.len);
+		kept = 1;
+		if (!data->mapped) {
+			spill_compress(&c);
+		} else if (map_guard(spill_compress, &c) < 0) {
+			/* truncated on disk under the mapping */
+			kept = 0;
+		}
+		if (kept) {
+			spill_append(s, data, c.buf, c.len, c.compressed, h);
+		}
+		free(c.buf);
+		file_data_put(data);
+	}
+	return NULL;
+}
+
+/* the spill file is created in the current directory, next to the files
+ * being served, and unlinked right away so that it goes with the server */
+struct spill *
+spill_init(unsigned long size)
+{
+	struct spill *s;
+	char name[] = "spill-XXXXXX";
+	pthread_t t;
+
+	assert(size > 0);
+	s = Malloc(sizeof(struct spill));
+	memset(s, 0, sizeof(struct spill));
+	SYS(s->fd = mkstemp(name));
+	SYS(unlink(name));
+	s->size = size;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->not_empty, NULL);
+	INIT_LIST_HEAD(&s->entries);
+	INIT_LIST_HEAD(&s->pending);
+	SYS(pthread_create(&t, NULL, spill_writer, s));
+	return s;
+}
+
+void
+spill_put(struct spill *s, struct file_data *data)
+{
+	unsigned long h = hash(data->file_name, strlen(data->file_name));
+	struct spill_pending *p;
+
+	if (!data->file_size || (unsigned long)data->file_size > s->size)
+		return;
+	pthread_mutex_lock(&s->lock);
+	if (spill_find(s, data->file_name, h)) {
+		/* still in the log, it was read back from there */
+	} else if (s->nr_pending >= SPILL_PENDING_MAX) {
+		s->overrun++;
+	} else {
+		p = Malloc(sizeof(struct spill_pending));
+		p->data = file_data_get(data);
+		list_add_tail(&p->list, &s->pending);
+		s->nr_pending++;
+		pthread_cond_signal(&s->not_empty);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+int
+spill_get(struct spill *s, struct file_data *data)
+{
+	unsigned long h = hash(data->file_name, strlen(data->file_name));
+	struct spill_entry *e;
+	unsigned long done, off, gen;
+	unsigned stored, size;
+	struct stat sbuf;
+	time_t mtime;
+	uLongf len;
+	char *buf, *file_buf;
+	int compressed, ok;
+	ssize_t n;
+
+	/* a stat is cheap next to reading the file, and keeps a file that has
+	 * changed since from being served */
+	if (stat(data->file_name, &sbuf) < 0)
+		return 0;
+	pthread_mutex_lock(&s->lock);
+	s->lookups++;
+	e = spill_find(s, data->file_name, h);
+	if (e && (e->mtime != sbuf.st_mtime || e->size != sbuf.st_size)) {
+		spill_drop(s, e);
+		s->stale++;
+		e = NULL;
+	}
+	if (!e || !e->written) {
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	}
+	off = e->off;
+	stored = e->len;
+	size = e->size;
+	mtime = e->mtime;
+	compressed = e->compressed;
+	gen = e->gen;
+	pthread_mutex_unlock(&s->lock);
+
+	buf = Malloc(stored);
+	for (done = 0; done < stored; done += n) {
+		n = pread(s->fd, buf + done, stored - done, off + done);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		SYS(n);
+		assert(n > 0);
+	}
+
+	/* the writer drops the entry before it writes over its place, so the
+	 * bytes read are the file's if the entry is still there */
+	pthread_mutex_lock(&s->lock);
+	e = spill_find(s, data->file_name, h);
+	ok = e && e->gen == gen;
+	if (ok)
+		s->hits++;
+	pthread_mutex_unlock(&s->lock);
+	if (!ok) {
+		free(buf);
+		return 0;
+	}
+
+	if (compressed) {
+		file_buf = Malloc(size);
+		len = size;
+		if (uncompress((Bytef *)file_buf, &len, (const Bytef *)buf,
+			       stored) != Z_OK || len != size) {
+			unix_error("spill file corrupt");
+		}
+		free(buf);
+		buf = file_buf;
+	}
+	data->file_buf = buf;
+	data->file_size = size;
+	data->file_mtime = mtime;
+	return 1;
+}
+
+void
+spill_stats(struct spill *s, FILE *out)
+{
+	pthread_mutex_lock(&s->lock);
+	fprintf(out, "spill size = %lu\n", s->size);
+	/* the bytes the files take in the log, and once read back */
+	fprintf(out, "spill files = %lu (%lu bytes, %lu uncompressed)\n",
+		s->nr_entries, s->stored, s->original);
+	fprintf(out, "spill files written = %lu, overwritten = %lu\n",
+		s->written, s->overwritten);
+	/* evicted while the writer was behind */
+	fprintf(out, "spill files not written = %lu\n", s->overrun);
+	/* changed on disk since they were written */
+	fprintf(out, "spill files stale = %lu\n", s->stale);
+	fprintf(out, "spill hits = %lu of %lu lookups, hit ratio = %.4f\n",
+		s->hits, s->lookups,
+		s->lookups ? (double)s->hits / s->lookups : 0.0);
+	pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,32 @@
+#ifndef __SPILL_H__
+#define __SPILL_H__
+
+#include <stdio.h>
+
+struct file_data;
+
+/* the warm tier of the cache: files evicted from memory are compressed and
+ * written to a spill file on local disk, so that a later miss reads them back
+ * from there instead of taking the slow path through request_readfile.
+ *
+ * the spill file is a log of size bytes that wraps around. each file is
+ * written in one piece where the log ends, over the oldest files, which are
+ * dropped, and read back with one pread. an index in memory maps the file
+ * names to their place in the log.
+ *
+ * spill_put only takes a reference to the data and queues it: a thread of
+ * the spill's own does the compressing and writing. files that are already in
+ * the log are not written again, and files are dropped rather than queued
+ * without bound when the writer falls behind. the spill's lock guards the
+ * index only, the log is read and written without it. */
+struct spill;
+
+struct spill *spill_init(unsigned long size);
+void spill_put(struct spill *s, struct file_data *data);
+/* reads data->file_name back into a new data->file_buf and sets
+ * data->file_size and data->file_mtime. returns 0 if the file is not in the
+ * log, or has changed on disk since it was written there */
+int spill_get(struct spill *s, struct file_data *data);
+void spill_stats(struct spill *s, FILE *out);
+
+#endif /* __SPILL_H__ */
@@ -0,0 +1,177 @@
+#include "common.h"
+#include "steal.h"
+#include "queue.h"
+#include "parking.h"
+
+/* times an idle worker looks through the queues before it parks, if there is
+ * another cpu that could be filling them meanwhile */
+#define STEAL_SPINS 64
+
+struct steal_worker {
+	struct queue *q;
+	unsigned long served;		/* popped by the worker */
+	unsigned long stolen;		/* of those, taken from other queues */
+	unsigned max_depth;		/* the most queued at once */
+} __attribute__((aligned(64)));
+
+struct steal {
+	int nr_workers;
+	int spins;
+	struct steal_worker *workers;
+	unsigned next;			/* gets the next push */
+	struct parking idle;		/* workers with nothing to do */
+	struct parking not_full;	/* the producer, when every queue is
+					 * full */
+};
+
+/* size entries are spread over the queues, each holds at least one */
+struct steal *
+steal_init(int nr_workers, unsigned size)
+{
+	struct steal *s;
+	int i;
+
+	assert(nr_workers > 0 && size > 0);
+	s = aligned_alloc(64, sizeof(struct steal));
+	if (!s) {
+		unix_error("aligned_alloc");
+	}
+	s->nr_workers = nr_workers;
+	s->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? STEAL_SPINS : 0;
+	s->workers = aligned_alloc(64, sizeof(struct steal_worker) *
+				   nr_workers);
+	if (!s->workers) {
+		unix_error("aligned_alloc");
+	}
+	for (i = 0; i < nr_workers; i++) {
+		struct steal_worker *w = &s->workers[i];
+
+		/* at least one each, rounding up */
+		w->q = queue_init((size + nr_workers - 1) / nr_workers);
+		w->served = 0;
+		w->stolen = 0;
+		w->max_depth = 0;
+	}
+	s->next = 0;
+	parking_init(&s->idle);
+	parking_init(&s->not_full);
+	return s;
+}
+
+void
+steal_destroy(struct steal *s)
+{
+	int i;
+
+	for (i = 0; i < s->nr_workers; i++) {
+		queue_destroy(s->workers[i].q);
+	}
+	free(s->workers);
+	free(s);
+}
+
+/* queues v for the next worker that has room, round robin. returns 0 if all
+ * of the queues are full */
+static int
+steal_try_push(struct steal *s, int v)
+{
+	struct steal_worker *w;
+	unsigned depth;
+	int i;
+
+	for (i = 0; i < s->nr_workers; i++) {
+		w = &s->workers[s->next++ % s->nr_workers];
+		if (queue_try_push(w->q, v)) {
+			/* only the producer writes max_depth */
+			depth = queue_depth(w->q);
+			if (depth > w->max_depth)
+				__atomic_store_n(&w->max_depth, depth,
+						 __ATOMIC_RELAXED);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* called by a single producer */
+void
+steal_push(struct steal *s, int v)
+{
+	unsigned int seq;
+	int i, done;
+
+	for (i = 0; !steal_try_push(s, v); i++) {
+		if (i < s->spins)
+			continue;
+		seq = parking_prepare(&s->not_full);
+		done = steal_try_push(s, v);
+		if (!done)
+			parking_wait(&s->not_full, seq);
+		parking_done(&s->not_full);
+		if (done)
+			break;
+	}
+	/* any idle worker takes it, from its own queue or by stealing */
+	parking_wake(&s->idle);
+}
+
+/* pops from the worker's own queue, else from another one, starting with
+ * its neighbour. returns 0 if every queue is empty */
+static int
+steal_try_pop(struct steal *s, int worker, int *v)
+{
+	struct steal_worker *w = &s->workers[worker];
+	int i;
+
+	for (i = 0; i < s->nr_workers; i++) {
+		if (queue_try_pop(s->workers[(worker + i) % s->nr_workers].q,
+				  v)) {
+			/* read by steal_stats while the workers run */
+			__atomic_add_fetch(&w->served, 1, __ATOMIC_RELAXED);
+			if (i > 0)
+				__atomic_add_fetch(&w->stolen, 1,
+						   __ATOMIC_RELAXED);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* called by worker number worker, waits for an entry */
+int
+steal_pop(struct steal *s, int worker)
+{
+	unsigned int seq;
+	int i, done, v;
+
+	for (i = 0; !steal_try_pop(s, worker, &v); i++) {
+		if (i < s->spins)
+			continue;
+		seq = parking_prepare(&s->idle);
+		done = steal_try_pop(s, worker, &v);
+		if (!done)
+			parking_wait(&s->idle, seq);
+		parking_done(&s->idle);
+		if (done)
+			break;
+	}
+	parking_wake(&s->not_full);
+	return v;
+}
+
+void
+steal_stats(struct steal *s, FILE *out)
+{
+	int i;
+
+	for (i = 0; i < s->nr_workers; i++) {
+		struct steal_worker *w = &s->workers[i];
+
+		fprintf(out, "worker %d: served = %lu, stolen = %lu, "
+			"depth = %u, max depth = %u\n", i,
+			__atomic_load_n(&w->served, __ATOMIC_RELAXED),
+			__atomic_load_n(&w->stolen, __ATOMIC_RELAXED),
+			queue_depth(w->q),
+			__atomic_load_n(&w->max_depth, __ATOMIC_RELAXED));
+	}
+}
@@ -0,0 +1,21 @@
+#ifndef __STEAL_H__
+#define __STEAL_H__
+
+#include <stdio.h>
+
+/* hands connections to a pool of worker threads. each worker has its own
+ * queue (see queue.h), which the producer fills round robin. a worker serves
+ * the connections in its own queue first. once that is empty, it steals from
+ * the queues of the others, so that a worker tied up by a slow connection
+ * does not hold up the connections queued behind it. only a worker that finds
+ * every queue empty parks, and the producer only wakes one up if one is
+ * parked. */
+struct steal;
+
+struct steal *steal_init(int nr_workers, unsigned size);
+void steal_push(struct steal *s, int v);
+int steal_pop(struct steal *s, int worker);
+void steal_stats(struct steal *s, FILE *out);
+void steal_destroy(struct steal *s);
+
+#endif /* __STEAL_H__ */
@@ -0,0 +1,254 @@
+#include <sys/syscall.h>
+#include "common.h"
+#include "uring.h"
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		   unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static void *
+uring_mmap(int fd, size_t size, off_t offset)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, offset);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/* returns 0 on success, or -1 with errno set, e.g. if the kernel has no
+ * io_uring */
+int
+uring_init(struct uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	memset(u, 0, sizeof(*u));
+	u->fd = sys_io_uring_setup(entries, &p);
+	if (u->fd < 0)
+		return -1;
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	u->sq_ring = uring_mmap(u->fd, u->sq_ring_size, IORING_OFF_SQ_RING);
+	u->cq_ring = uring_mmap(u->fd, u->cq_ring_size, IORING_OFF_CQ_RING);
+	u->sqes = uring_mmap(u->fd, u->sqes_size, IORING_OFF_SQES);
+	if (!u->sq_ring || !u->cq_ring || !u->sqes) {
+		uring_destroy(u);
+		return -1;
+	}
+
+	u->sq_head = (unsigned *)(u->sq_ring + p.sq_off.head);
+	u->sq_tail = (unsigned *)(u->sq_ring + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(u->sq_ring + p.sq_off.array);
+	u->sq_entries = p.sq_entries;
+	u->sqe_tail = *u->sq_tail;
+	u->cq_head = (unsigned *)(u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned *)(u->cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(u->cq_ring + p.cq_off.cqes);
+	return 0;
+}
+
+void
+uring_destroy(struct uring *u)
+{
+	if (u->sq_ring)
+		munmap(u->sq_ring, u->sq_ring_size);
+	if (u->cq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->fd >= 0)
+		close(u->fd);
+	free(u->backlog);
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+/* moves the completions on the queue to the backlog, so that the kernel can
+ * post the ones it holds back. returns how many it moved */
+static unsigned
+uring_reap(struct uring *u)
+{
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned n = tail - head;
+	unsigned len = u->backlog_tail - u->backlog_head;
+
+	if (!n)
+		return 0;
+	/* the consumed entries at the front make room first */
+	if (u->backlog_head) {
+		memmove(u->backlog, u->backlog + u->backlog_head,
+			len * sizeof(struct io_uring_cqe));
+		u->backlog_head = 0;
+		u->backlog_tail = len;
+	}
+	if (len + n > u->backlog_size) {
+		u->backlog_size = len + n > 2 * u->backlog_size ?
+			len + n : 2 * u->backlog_size;
+		u->backlog = realloc(u->backlog, u->backlog_size *
+				     sizeof(struct io_uring_cqe));
+		assert(u->backlog);
+	}
+	for (; head != tail; head++) {
+		u->backlog[u->backlog_tail++] = u->cqes[head & *u->cq_mask];
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+struct io_uring_sqe *
+uring_get_sqe(struct uring *u)
+{
+	unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = u->sqe_tail;
+	struct io_uring_sqe *sqe;
+
+	if (tail - head == u->sq_entries) {
+		/* full, hand the queued entries to the kernel */
+		if (uring_submit_and_wait(u, 0) < 0) {
+			unix_error("io_uring_enter error");
+		}
+		head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+		assert(tail - head < u->sq_entries);
+	}
+	sqe = &u->sqes[tail & *u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+	/* the kernel sees the entry once uring_submit_and_wait moves the
+	 * tail, by then the caller has filled it in */
+	u->sqe_tail = tail + 1;
+	u->to_submit++;
+	return sqe;
+}
+
+/* returns how many entries can be queued before the queue is full */
+unsigned
+uring_sq_space(struct uring *u)
+{
+	return u->sq_entries - (u->sqe_tail -
+				__atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/* returns the number of entries submitted, or -1 with errno set. does not
+ * wait while there are completions in the backlog */
+int
+uring_submit_and_wait(struct uring *u, unsigned wait_nr)
+{
+	int ret;
+
+	/* publish the filled in entries */
+	__atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+	while (1) {
+		if (u->backlog_head != u->backlog_tail)
+			wait_nr = 0;
+		ret = sys_io_uring_enter(u->fd, u->to_submit, wait_nr,
+					 wait_nr ? IORING_ENTER_GETEVENTS : 0);
+		if (ret >= 0 ||
+		    (errno != EINTR && errno != EBUSY && errno != EAGAIN))
+			break;
+		if (errno != EINTR && !uring_reap(u)) {
+			/* the kernel posts the completions it held back, if
+			 * any, without waiting for more */
+			sys_io_uring_enter(u->fd, 0, 0,
+					   IORING_ENTER_GETEVENTS);
+			uring_reap(u);
+		}
+	}
+	if (ret > 0)
+		u->to_submit -= ret;
+	return ret;
+}
+
+/* returns the oldest completion, or NULL if there is none. the backlog holds
+ * the older ones */
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *u)
+{
+	unsigned head = *u->cq_head;
+
+	if (u->backlog_head != u->backlog_tail)
+		return &u->backlog[u->backlog_head];
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &u->cqes[head & *u->cq_mask];
+}
+
+void
+uring_cqe_seen(struct uring *u)
+{
+	if (u->backlog_head != u->backlog_tail) {
+		u->backlog_head++;
+		return;
+	}
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void
+uring_prep_accept(struct io_uring_sqe *sqe, int fd, void *user_data)
+{
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->user_data = (unsigned long)user_data;
+}
+
+void
+uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, size_t len,
+		void *user_data)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->user_data = (unsigned long)user_data;
+}
+
+void
+uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg,
+		   unsigned flags, void *user_data)
+{
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)msg;
+	sqe->len = 1;
+	sqe->msg_flags = flags;
+	sqe->user_data = (unsigned long)user_data;
+}
+
+void
+uring_prep_poll_add(struct io_uring_sqe *sqe, int fd, unsigned events,
+		    void *user_data)
+{
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	/* the kernel reads 32 bits, the upper half stays 0 on little endian */
+	sqe->poll_events = events;
+	sqe->user_data = (unsigned long)user_data;
+}
+
+/* ts must stay valid until the entry has been submitted */
+void
+uring_prep_link_timeout(struct io_uring_sqe *sqe,
+			const struct __kernel_timespec *ts, void *user_data)
+{
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long)ts;
+	sqe->len = 1;
+	sqe->user_data = (unsigned long)user_data;
+}
@@ -0,0 +1,58 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+
+/* a minimal io_uring wrapper on top of the raw system calls.
+ *
+ * uring_get_sqe returns the next free submission entry, submitting the queued
+ * ones first if the queue is full. the caller fills it in with one of the
+ * uring_prep_* functions. uring_submit_and_wait submits all queued entries
+ * and waits for at least wait_nr completions in a single system call.
+ * completions are then consumed with uring_peek_cqe and uring_cqe_seen. the
+ * entry peeked is only valid until then, or until the next uring_get_sqe.
+ *
+ * the kernel refuses new entries, with EBUSY or EAGAIN, while completions it
+ * could not post because the completion queue was full are waiting. both
+ * submitting functions then move the completions on the queue to a backlog
+ * of the ring's own, where uring_peek_cqe finds them first, and try again */
+struct uring {
+	int fd;
+	/* submission queue */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_entries;
+	unsigned sqe_tail;	/* the kernel's tail, plus the queued entries */
+	unsigned to_submit;	/* queued but not yet submitted */
+	/* completion queue */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* completions taken off the queue to make room, oldest first */
+	struct io_uring_cqe *backlog;
+	unsigned backlog_head, backlog_tail, backlog_size;
+	/* the mappings, for uring_destroy */
+	char *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+int  uring_init(struct uring *u, unsigned entries);
+void uring_destroy(struct uring *u);
+struct io_uring_sqe *uring_get_sqe(struct uring *u);
+unsigned uring_sq_space(struct uring *u);
+int  uring_submit_and_wait(struct uring *u, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(struct uring *u);
+void uring_cqe_seen(struct uring *u);
+
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, void *user_data);
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, size_t len,
+		     void *user_data);
+void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+			const struct msghdr *msg, unsigned flags,
+			void *user_data);
+void uring_prep_poll_add(struct io_uring_sqe *sqe, int fd, unsigned events,
+			 void *user_data);
+void uring_prep_link_timeout(struct io_uring_sqe *sqe,
+			     const struct __kernel_timespec *ts,
+			     void *user_data);
+
+#endif /* __URING_H__ */